@@ -102,6 +102,18 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Return a locked buf for the indicated block, without reading it
+// from disk: the caller overwrites all of b->data.
+struct buf*
+bgetw(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  b->valid = 1;
+  return b;
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -4,6 +4,7 @@ struct file;
 struct inode;
 struct pipe;
 struct proc;
+struct shm;
 struct spinlock;
 struct sleeplock;
 struct stat;
@@ -12,6 +13,7 @@ struct superblock;
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     bgetw(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
 void            bpin(struct buf*);
@@ -24,6 +26,9 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+struct seg*     segfind(struct proc*, uint64, uint64);
+int             segfault(struct proc*, struct seg*, uint64);
+void            segput(struct seg*);
 
 // file.c
 struct file*    filealloc(void);
@@ -62,6 +67,11 @@ void            ramdiskrw(struct buf*);
 // kalloc.c
 
 void*           kalloc(int);
+void*           kalloc_zeroed(void);
+void*           kalloc_mega(void);
+void            kfree_mega(void *);
+int             kzero_idle(void);
+void            kzerodinit(void);
 void            kfree(void *, int);
 
 void            kinit(void);
@@ -72,6 +82,33 @@ void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
 
+// memcg.c
+void            memcginit(void);
+void            memcg_join(int);
+void            memcg_leave(int);
+int             memcg_current(void);
+void            memcg_charge(int, int);
+void*           memcg_reclaim(int, int);
+void            memcgprint(void);
+
+// mmap.c
+struct vma*     vmafind(struct proc*, uint64, uint64);
+uint64          vmabase(struct proc*);
+struct vma*     vmaalloc(struct proc*, uint64);
+int             vmafault(struct proc*, struct vma*, uint64);
+int             vmadirty(struct proc*, uint64);
+int             vmaunmap(struct proc*, struct vma*, uint64, uint64);
+void            vmafree(struct proc*);
+int             vmacopy(struct proc*, struct proc*);
+void            madvfault(struct proc*, uint64);
+
+// shm.c
+void            shminit(void);
+int             shmfault(struct proc*, struct vma*, uint64);
+void            shmdup(struct shm*);
+void            shmput(struct shm*);
+struct shm*     shmfile(struct inode*, int);
+
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
@@ -88,6 +125,7 @@ int             cpuid(void);
 void            exit(int);
 int             fork(void);
 int             growproc(int);
+struct proc*    kproc(void (*)(void), char*);
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
@@ -104,6 +142,7 @@ void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             wait(uint64);
 void            wakeup(void*);
+void            wakeproc(struct proc*, void*);
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
@@ -160,13 +199,24 @@ int             uartgetc(void);
 // vm.c
 void            kvminit(void);
 void            kvminithart(void);
+void            asidinit(void);
+uint64          uvmsatp(struct proc*);
+uint            uvmflush(uint64, uint64);
+void            uvmflush_wait(uint);
 void            kvmmap(pagetable_t, uint64, uint64, uint64, int);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
 pagetable_t     uvmcreate(void);
 void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
-int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcopy(pagetable_t, pagetable_t, uint64, uint64);
+int             uvmcow(pagetable_t, uint64);
+int             uvmlazy(pagetable_t, uint64, uint64, int);
+int             vmfault(struct proc*, uint64);
+void            vmprefault(pagetable_t, uint64);
+int             uvmfilepage(pagetable_t, uint64, struct inode*, uint64, uint, int);
+pte_t *         walkmega(pagetable_t, uint64);
+int             megasplit_one(void);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
@@ -196,17 +246,24 @@ void* zalloc(int type);
 void zfree(void* pa, int type);
 void mallocstat(void);
 void initAlloc(void);
-void* swapout(void);
+void* swapout(int droplock);
 void* swapin(pagetable_t, uint64 va);
-void update_ipt(uint64 pa, pagetable_t pagetable, uint64 va);
+void swapin_readahead(struct proc *p, uint64 va);
+void swapin_account(struct proc *p, uint64 dt);
+void rmap_add(uint64 pa, pagetable_t pagetable, uint64 va);
 void init_zmem(void);
+void zwriteback(void);
+int zwriteback_sync(void);
+void kswapdinit(void);
+void kswapd_wakeup(void);
+void kscandinit(void);
+int kscan_idle(void);
+int zreadback(pagetable_t pagetable, uint64 va);
+void zreadback_range(pagetable_t pagetable, uint64 va, uint64 len);
 
 int pa2idx_normal(uint64 pa);
 void init_zmem(void);
 int pa2idx_zmem(uint64 pa);
-void acquire_ipt_lock(uint64 pa);
-void release_ipt_lock(uint64 pa);
-int holding_pa(uint64 pa);
 
 
 // number of elements in fixed-size array
@@ -5,11 +5,9 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "resource.h"
 #include "elf.h"
 
-static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
-extern void release_normal_lock();
-
 int flags2perm(int flags)
 {
     int perm = 0;
@@ -25,12 +23,16 @@ exec(char *path, char **argv)
 {
   char *s, *last;
   int i, off;
-  uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
+  uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase, stacklim;
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
+  struct seg seg[NSEG];
+  int nseg = 0;
+
+  memset(seg, 0, sizeof(seg));
 
   begin_op();
 
@@ -50,7 +52,8 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Record the program segments; their pages are read in
+  // from ip as they are first touched.
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -62,29 +65,33 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
-      goto bad;
-    sz = sz1;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(ph.vaddr + ph.memsz >= TRAPFRAME || nseg == NSEG)
       goto bad;
+    seg[nseg].ip = idup(ip);
+    seg[nseg].va = ph.vaddr;
+    seg[nseg].memsz = ph.memsz;
+    seg[nseg].off = ph.off;
+    seg[nseg].filesz = ph.filesz;
+    seg[nseg].perm = flags2perm(ph.flags) | PTE_R | PTE_U;
+    nseg++;
+    if(ph.vaddr + ph.memsz > sz)
+      sz = ph.vaddr + ph.memsz;
   }
   iunlockput(ip);
   end_op();
   ip = 0;
 
-  p = myproc();
   uint64 oldsz = p->sz;
 
-  // Allocate some pages at the next page boundary.
-  // Make the first inaccessible as a stack guard.
-  // Use the rest as the user stack.
+  // Reserve RLIMIT_STACK bytes at the next page boundary above
+  // a guard page that is never mapped. Allocate the top USERSTACK
+  // pages for the arguments; vmfault() adds the rest as the stack
+  // grows down into them.
   sz = PGROUNDUP(sz);
-  uint64 sz1;
-  if((sz1 = uvmalloc(pagetable, sz, sz + (USERSTACK+1)*PGSIZE, PTE_W)) == 0)
+  stacklim = sz + PGSIZE;
+  sz = stacklim + PGROUNDUP(p->rlim[RLIMIT_STACK]);
+  if(uvmalloc(pagetable, sz - USERSTACK*PGSIZE, sz, PTE_W) == 0)
     goto bad;
-  sz = sz1;
-  uvmclear(pagetable, sz-(USERSTACK+1)*PGSIZE);
   sp = sz;
   stackbase = sp - USERSTACK*PGSIZE;
 
@@ -122,48 +129,77 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  vmafree(p);
   oldpagetable = p->pagetable;
+  // pmemstat() walks p->pagetable under p->lock.
+  acquire(&p->lock);
   p->pagetable = pagetable;
   p->sz = sz;
+  release(&p->lock);
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
+  p->ra_next = p->ra_start = p->ra_mask = 0;
+  p->ra_win = 0;
+  p->madv_start = p->madv_end = 0;
+  p->stacklim = stacklim;
+  p->stacktop = sz;
+  // the old image's TLB entries carry the old ASID.
+  p->asidgen = 0;
   proc_freepagetable(oldpagetable, oldsz);
+  begin_op();
+  segput(p->seg);
+  end_op();
+  memmove(p->seg, seg, sizeof(seg));
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
  bad:
   if(pagetable)
     proc_freepagetable(pagetable, sz);
-  if(ip){
+  if(ip)
     iunlockput(ip);
-    end_op();
-  }
+  else
+    begin_op();
+  segput(seg);
+  end_op();
   return -1;
 }
 
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
+// Drop the inode references of a process's segments.
+// Must be called inside a transaction.
+void
+segput(struct seg *s)
 {
-  uint i, n;
-  uint64 pa; 
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    release_normal_lock();
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
-    // release_normal_lock();
+  for(int i = 0; i < NSEG; i++){
+    if(s[i].ip)
+      iput(s[i].ip);
+    s[i].ip = 0;
   }
-  
+}
+
+// Return the segment of p that overlaps [va, va+len), or 0.
+struct seg*
+segfind(struct proc *p, uint64 va, uint64 len)
+{
+  struct seg *s;
+
+  for(s = p->seg; s < &p->seg[NSEG]; s++)
+    if(s->ip && va < PGROUNDUP(s->va + s->memsz) && s->va < va + len)
+      return s;
   return 0;
 }
+
+// Read the page at va of segment s of the current process p
+// into a new frame and map it. Returns 0 on success.
+int
+segfault(struct proc *p, struct seg *s, uint64 va)
+{
+  uint64 off;
+
+  va = PGROUNDDOWN(va);
+  off = va - s->va;
+  if(off >= s->filesz)
+    return uvmfilepage(p->pagetable, va, 0, 0, 0, s->perm);
+  return uvmfilepage(p->pagetable, va, s->ip, s->off + off,
+                     s->filesz - off < PGSIZE ? s->filesz - off : PGSIZE, s->perm);
+}
@@ -118,10 +118,33 @@ fileread(struct file *f, uint64 addr, int n)
       return -1;
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
-    ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
-      f->off += r;
-    iunlock(f->ip);
+    // faulting in a page of a program or mapped file takes its
+    // inode's lock, which may be f->ip's, so each chunk's pages
+    // are faulted in before ilock(). Only those readi() will fill
+    // are, so a large buffer near end of file stays lazy; the size
+    // is read without the lock and just bounds the chunk.
+    int max = 8 * PGSIZE;
+    int n1, m;
+    while(r < n){
+      n1 = n - r;
+      if(n1 > max)
+        n1 = max;
+      m = (int)f->ip->size - (int)f->off;
+      if(m <= 0)
+        break;
+      if(n1 > m)
+        n1 = m;
+      zreadback_range(myproc()->pagetable, addr + r, n1);
+      ilock(f->ip);
+      if((m = readi(f->ip, 1, addr + r, f->off, n1)) > 0)
+        f->off += m;
+      iunlock(f->ip);
+      if(m < 0 && r == 0)
+        r = -1;
+      if(m <= 0)
+        break;
+      r += m;
+    }
   } else {
     panic("fileread");
   }
@@ -159,6 +182,8 @@ filewrite(struct file *f, uint64 addr, int n)
       if(n1 > max)
         n1 = max;
 
+      // see fileread()
+      zreadback_range(myproc()->pagetable, addr + i, n1);
       begin_op();
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
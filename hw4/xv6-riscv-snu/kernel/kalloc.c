@@ -35,13 +35,24 @@ struct page_info {
   int next;
   int prev;
   int in_queue;
+  int cg;       // memory group charged for the frame, or -1
 };
 
 struct {
   struct spinlock lock;
   struct run *freelist;
+  struct run *zeroed;   // free frames known to be zero-filled
+  int nzeroed;
 } kmem_normal;
 
+// Debug builds (make POISON=1) fill pages with junk on kalloc()
+// and kfree() to catch use of uninitialized or freed memory.
+#ifdef POISON
+#define poison(pa, c)   memset((pa), (c), PGSIZE)
+#else
+#define poison(pa, c)
+#endif
+
 struct spinlock* a_lock = &kmem_normal.lock;
 
 void acquire_normal_lock(){
@@ -71,11 +82,59 @@ struct {
   struct run *freelist;
 } kmem_fixed;
 
+// Per-CPU magazines of free ZONE_FIXED pages.
+// kalloc()/kfree() take kmem_fixed.lock only to move MAG_BATCH
+// pages between a magazine and the freelist when it runs empty
+// or full. Accessed with interrupts off. A CPU can keep up to
+// MAG_SIZE-1 free pages to itself; ZONE_FIXED is large enough
+// for that not to matter.
+#define MAG_SIZE    32
+#define MAG_BATCH   16
+
+struct {
+  struct run *list;
+  int n;
+} kmag[NCPU];
+
+// Move up to MAG_BATCH pages from the freelist to magazine m.
+static void
+mag_refill(int m)
+{
+  struct run *r;
+
+  acquire(&kmem_fixed.lock);
+  while(kmag[m].n < MAG_BATCH && (r = kmem_fixed.freelist) != 0){
+    kmem_fixed.freelist = r->next;
+    r->next = kmag[m].list;
+    kmag[m].list = r;
+    kmag[m].n++;
+  }
+  release(&kmem_fixed.lock);
+}
+
+// Give MAG_BATCH pages of magazine m back to the freelist.
+static void
+mag_drain(int m)
+{
+  struct run *r;
+
+  acquire(&kmem_fixed.lock);
+  while(kmag[m].n > MAG_SIZE - MAG_BATCH){
+    r = kmag[m].list;
+    kmag[m].list = r->next;
+    kmag[m].n--;
+    r->next = kmem_fixed.freelist;
+    kmem_fixed.freelist = r;
+  }
+  release(&kmem_fixed.lock);
+}
+
 void init_fifo(){
   for(int i = 0; i<MEM ;i++){
     kmem_fifo.pages[i].next = -1;
     kmem_fifo.pages[i].prev = -1;
     kmem_fifo.pages[i].in_queue = 0;
+    kmem_fifo.pages[i].cg = -1;
   }
   kmem_fifo.head = -1;
   kmem_fifo.tail = -1;
@@ -174,6 +233,53 @@ delete(uint64 pa) {
   return 0;
 }
 
+// Make the queued frame pa the next victim.
+// kmem_normal.lock must be held.
+void
+enqueue_head(uint64 pa) {
+  int idx = pa2idx_fifo(pa);
+
+  if (idx == -1 || !kmem_fifo.pages[idx].in_queue || kmem_fifo.head == idx)
+    return;
+  delete(pa);
+  kmem_fifo.pages[idx].in_queue = 1;
+  kmem_fifo.pages[idx].prev = -1;
+  kmem_fifo.pages[idx].next = kmem_fifo.head;
+  kmem_fifo.pages[kmem_fifo.head].prev = idx;
+  kmem_fifo.head = idx;
+}
+
+// Take the oldest queued frame charged to memory group cg off the
+// FIFO, as dequeue() takes the oldest of all. Returns 0 if none is.
+// kmem_normal.lock must be held.
+uint64
+dequeue_memcg(int cg) {
+  int idx;
+
+  for(idx = kmem_fifo.head; idx != -1; idx = kmem_fifo.pages[idx].next){
+    if(kmem_fifo.pages[idx].cg == cg){
+      delete(idx2pa_fifo(idx));
+      return idx2pa_fifo(idx);
+    }
+  }
+  return 0;
+}
+
+// Charge the frame pa to memory group cg, taking the charge from
+// its previous group if it was reclaimed rather than free.
+// cg -1 uncharges it. kmem_normal.lock must be held.
+static void
+charge(uint64 pa, int cg)
+{
+  struct page_info *pi = &kmem_fifo.pages[pa2idx_fifo(pa)];
+
+  if(pi->cg >= 0)
+    memcg_charge(pi->cg, -1);
+  pi->cg = cg;
+  if(cg >= 0)
+    memcg_charge(cg, 1);
+}
+
 void
 kinit()
 {
@@ -246,27 +352,30 @@ kfree(void *pa, int zone)
   else if(zone == ZONE_NORMAL && (uint64)pa < NORMAL_START) 
     panic("kfree");
 
-  memset(pa, 1, PGSIZE);
+  poison(pa, 1);
 
   r = (struct run*)pa;
 
   if(zone == ZONE_FIXED){
-    acquire(&kmem_fixed.lock);
     int idx = pa2idx_fixed((uint64)pa);
     if(kfreestart && fixed_page_allocated[idx] == 0){
-      release(&kmem_fixed.lock);
       panic("kfree");
     }
     fixed_page_allocated[idx] = 0;
-    r->next = kmem_fixed.freelist;
-    kmem_fixed.freelist = r;
-    release(&kmem_fixed.lock);
+    push_off();
+    int m = cpuid();
+    r->next = kmag[m].list;
+    kmag[m].list = r;
+    if(++kmag[m].n >= MAG_SIZE)
+      mag_drain(m);
+    pop_off();
   }
   else if(zone == ZONE_NORMAL){
     acquire_normal_lock();
     if(kfreestart && delete((uint64)r) < 0){
       panic("kfree");
     }
+    charge((uint64)r, -1);
 
     nalloc4k--;
 
@@ -276,6 +385,67 @@ kfree(void *pa, int zone)
   
 }
 
+// kalloc(ZONE_NORMAL): returns with kmem_normal.lock held.
+// If zero is set the frame is zero-filled, preferably from
+// the pre-zeroed pool; otherwise dirty frames are used first.
+static void *
+kalloc_normal(int zero)
+{
+  struct run *r, **first, **second;
+  int cg = memcg_current();
+
+  // a caller that did not hold the lock has nothing for
+  // swapout() to invalidate, so it may compress unlocked.
+  int held = holding(&kmem_normal.lock);
+  acquire_normal_lock();
+  first = zero ? &kmem_normal.zeroed : &kmem_normal.freelist;
+  second = zero ? &kmem_normal.freelist : &kmem_normal.zeroed;
+  if((r = memcg_reclaim(cg, !held)) != 0){
+    // a group at its limit pays with one of its own frames
+    if(zero)
+      memset((char*)r, 0, PGSIZE);
+  }
+  else if((r = *first) != 0 || (r = *second) != 0){
+    nalloc4k++;
+    if(r == kmem_normal.zeroed){
+      kmem_normal.zeroed = r->next;
+      kmem_normal.nzeroed--;
+      r->next = 0;        // the only non-zero word
+    } else {
+      kmem_normal.freelist = r->next;
+      if(zero)
+        memset((char*)r, 0, PGSIZE);
+    }
+  }
+  else{
+    // reclaim a batch; keep one frame and free the rest
+    void *pa[SWAPOUT_BATCH];
+    int n = swapout_batch(pa, SWAPOUT_BATCH, !held);
+    if(n == 0)
+      n = (pa[0] = swapout(!held)) != 0;
+    // ZONE_ZMEM may be full; move some of it to disk and retry
+    if(n == 0 && !held && zwriteback_sync() > 0)
+      n = swapout_batch(pa, SWAPOUT_BATCH, 1);
+    r = n > 0 ? (struct run*)pa[0] : 0;
+    for(int i = 1; i < n; i++)
+      kfree(pa[i], ZONE_NORMAL);
+    if(r && zero)
+      memset((char*)r, 0, PGSIZE);
+  }
+  if(MEM - nalloc4k < KSWAPD_LOW)
+    kswapd_wakeup();
+
+  if(r)
+  {
+    if(!zero)
+      poison((char*)r, 5);
+    enqueue((uint64)r);
+    charge((uint64)r, cg);
+  }
+
+  return (void*)r;
+}
+
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
@@ -284,40 +454,173 @@ kalloc(int zone)
 {
   struct run *r;
   if(zone == ZONE_FIXED){
-    acquire(&kmem_fixed.lock);
-    r = kmem_fixed.freelist;
-    if(r)
-      kmem_fixed.freelist = r->next;
+    push_off();
+    int m = cpuid();
+    if(kmag[m].n == 0)
+      mag_refill(m);
+    r = kmag[m].list;
+    if(r){
+      kmag[m].list = r->next;
+      kmag[m].n--;
+    }
+    pop_off();
 
     if(r)
     {
       int idx = pa2idx_fixed((uint64)r);
       fixed_page_allocated[idx] = 1;
-      memset((char*)r, 5, PGSIZE); // fill with junk
+      poison((char*)r, 5); // fill with junk
     }
-    release(&kmem_fixed.lock);
     return (void*)r;
   }
   else if(zone == ZONE_NORMAL){
-    acquire_normal_lock();
-    r = kmem_normal.freelist;
-    if(r){
-      nalloc4k++;
-      kmem_normal.freelist = r->next;
-    }
-    else{
-      r = (struct run*) swapout();
-    }
-    
-    if(r)
-    {
-      memset((char*)r, 5, PGSIZE);
-      enqueue((uint64)r);
-    }
-      
-    return (void*)r;
+    return kalloc_normal(0);
   }
   else{
     return 0;
   }
 }
+
+// Like kalloc(ZONE_NORMAL), but the frame is zero-filled.
+// Frames come from the pool kzerod fills while the CPUs are idle,
+// so the caller usually does not pay for the memset.
+void *
+kalloc_zeroed(void)
+{
+  return kalloc_normal(1);
+}
+
+// Allocate a 2MB-aligned run of free ZONE_NORMAL frames for a
+// megapage, zero-filled. Its frames stay out of the FIFO (and so
+// out of swapout()'s reach) until the megapage is split.
+// Returns 0 if no run is entirely free.
+void *
+kalloc_mega(void)
+{
+  struct run *r, **pp, **lists[2];
+  int nfree[NMEGA + 1];
+  int i, m;
+  uint64 base;
+
+  if(NMEGA == 0)
+    return 0;
+  acquire_normal_lock();
+  memset(nfree, 0, sizeof(nfree));
+  lists[0] = &kmem_normal.freelist;
+  lists[1] = &kmem_normal.zeroed;
+  for(i = 0; i < 2; i++)
+    for(r = *lists[i]; r; r = r->next)
+      nfree[((uint64)r - NORMAL_START) / MEGAPGSIZE]++;
+  for(m = 0; m < NMEGA && nfree[m] < MEGAPGSIZE / PGSIZE; m++)
+    ;
+  if(m == NMEGA){
+    release_normal_lock();
+    return 0;
+  }
+  base = NORMAL_START + (uint64)m * MEGAPGSIZE;
+  for(i = 0; i < 2; i++){
+    for(pp = lists[i]; (r = *pp) != 0; ){
+      if((uint64)r >= base && (uint64)r < base + MEGAPGSIZE){
+        *pp = r->next;
+        if(i == 1)
+          kmem_normal.nzeroed--;
+      } else {
+        pp = &r->next;
+      }
+    }
+  }
+  nalloc4k += MEGAPGSIZE / PGSIZE;
+  for(i = 0; i < MEGAPGSIZE / PGSIZE; i++)
+    charge(base + i * PGSIZE, memcg_current());
+  release_normal_lock();
+  memset((char*)base, 0, MEGAPGSIZE);
+  return (void*)base;
+}
+
+// Free a run from kalloc_mega() that was never split.
+// kmem_normal.lock must be held; it stays held, like kfree().
+void
+kfree_mega(void *pa)
+{
+  struct run *r;
+  int i;
+
+  if(((uint64)pa % MEGAPGSIZE) != 0 || (uint64)pa < NORMAL_START ||
+     (uint64)pa + MEGAPGSIZE > PHYSTOP)
+    panic("kfree_mega");
+  for(i = 0; i < MEGAPGSIZE / PGSIZE; i++){
+    r = (struct run*)((char*)pa + i * PGSIZE);
+    poison((char*)r, 1);
+    charge((uint64)r, -1);
+    r->next = kmem_normal.freelist;
+    kmem_normal.freelist = r;
+  }
+  nalloc4k -= MEGAPGSIZE / PGSIZE;
+}
+
+// Background zeroing of free ZONE_NORMAL frames.
+//
+// The scheduler wakes kzerod when a CPU has nothing else to run.
+// kzerod zeroes one frame from the freelist per wakeup, until
+// KZERO_POOL frames are waiting in kmem_normal.zeroed.
+
+struct {
+  struct spinlock lock;
+  struct proc *proc;
+  int pending;
+} kzero;
+
+// Called from scheduler() with no locks held.
+// Returns 1 if kzerod was given work.
+int
+kzero_idle(void)
+{
+  if(kzero.proc == 0 || kzero.pending || kmem_normal.freelist == 0 ||
+     kmem_normal.nzeroed >= KZERO_POOL)
+    return 0;
+  acquire(&kzero.lock);
+  kzero.pending = 1;
+  wakeproc(kzero.proc, &kzero);
+  release(&kzero.lock);
+  return 1;
+}
+
+static void
+kzerod_main(void)
+{
+  struct run *r;
+
+  for(;;){
+    acquire(&kzero.lock);
+    while(!kzero.pending)
+      sleep(&kzero, &kzero.lock);
+    release(&kzero.lock);
+
+    // don't spin on a lock a sleeping process may hold.
+    // the frame is zeroed under the lock, so that it is never
+    // off both lists while kalloc() and kswapd count free ones.
+    if(!kmem_normal.lock.locked){
+      acquire_normal_lock();
+      if((r = kmem_normal.freelist) != 0){
+        kmem_normal.freelist = r->next;
+        memset((char*)r, 0, PGSIZE);
+        r->next = kmem_normal.zeroed;
+        kmem_normal.zeroed = r;
+        kmem_normal.nzeroed++;
+      }
+      release_normal_lock();
+    }
+
+    acquire(&kzero.lock);
+    kzero.pending = 0;
+    release(&kzero.lock);
+  }
+}
+
+void
+kzerodinit(void)
+{
+  initlock(&kzero.lock, "kzero");
+  kzero.pending = 0;
+  kzero.proc = kproc(kzerod_main, "kzerod");
+}
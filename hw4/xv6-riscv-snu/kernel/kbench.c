@@ -0,0 +1,232 @@
+//----------------------------------------------------------------
+//
+//  In-kernel microbenchmarks for the Xswap allocators.
+//
+//  kbench(test, arg) runs the selected test and returns the
+//  elapsed time in r_time() ticks (10MHz on qemu virt).
+//
+//----------------------------------------------------------------
+
+#include "param.h"
+#include "types.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "defs.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "xswap.h"
+
+#define KBENCH_ZFREE      1
+#define KBENCH_ZSTORE     2
+#define KBENCH_LZO_C      3
+#define KBENCH_LZO_D      4
+
+int lzo1x_compress(const unsigned char *src, uint32 src_len, unsigned char *dst, uint32 *dst_len, void *wrkmem);
+int lzo1x_decompress(const unsigned char *src, uint32 src_len, unsigned char *dst, uint32 *dst_len);
+
+#define ZB_NITER          256     // timed zfree() calls
+#define ZB_MAXFRAG        2048    // max free 2KB fragments to plant
+
+static void *zb_timed[ZB_NITER][2];
+static void *zb_frag[ZB_MAXFRAG][2];
+static void *zb_stray;    // halves that are no use, chained through their first word
+
+// Allocate up to n pairs of ZHALF objects that are the two halves
+// of one page. Halves whose buddy someone else holds come first
+// off freelist_2kb; they are set aside on zb_stray.
+// Returns the number of pairs.
+static int
+zb_pairs(void *pair[][2], int n)
+{
+  void *x = 0, *y;
+  int i = 0;
+
+  while(i < n && (y = zalloc(ZHALF)) != 0){
+    if(x && ((uint64)x ^ (uint64)y) == HPGSIZE){
+      pair[i][0] = x;
+      pair[i][1] = y;
+      i++;
+      x = 0;
+      continue;
+    }
+    if(x){
+      *(void **)x = zb_stray;
+      zb_stray = x;
+    }
+    x = y;
+  }
+  if(x){
+    *(void **)x = zb_stray;
+    zb_stray = x;
+  }
+  return i;
+}
+
+// Time ZB_NITER ZHALF frees whose buddies sit behind nfrag
+// unrelated fragments at the far end of freelist_2kb.
+// The cost of a buddy merge should not depend on nfrag.
+static uint64
+kbench_zfree(int nfrag)
+{
+  int i, n, nfree;
+  uint64 start, end;
+  void *x;
+
+  if(nfrag < 0)
+    nfrag = 0;
+  if(nfrag > ZB_MAXFRAG)
+    nfrag = ZB_MAXFRAG;
+
+  // Allocate everything first, so that no free merges yet.
+  n = zb_pairs(zb_timed, ZB_NITER);
+  nfree = zb_pairs(zb_frag, nfrag);
+
+  // Free one half of every pair, the timed ones first: ZB_NITER
+  // free buddies with nfrag fragments in front of them.
+  for(i = 0; i < n; i++)
+    zfree(zb_timed[i][1], ZHALF);
+  for(i = 0; i < nfree; i++)
+    zfree(zb_frag[i][1], ZHALF);
+
+  start = r_time();
+  for(i = 0; i < n; i++)
+    zfree(zb_timed[i][0], ZHALF);
+  end = r_time();
+
+  for(i = 0; i < nfree; i++)
+    zfree(zb_frag[i][0], ZHALF);
+  while((x = zb_stray) != 0){
+    zb_stray = *(void **)x;
+    zfree(x, ZHALF);
+  }
+
+  if(n < ZB_NITER)
+    printf("kbench: zmem exhausted after %d pairs\n", n);
+  return end - start;
+}
+
+#define ZS_NITER          256     // timed zstore()/zload() round trips
+
+#define ZS_SWAPTEST       0       // int rows like swaptest's a[][]
+#define ZS_RANDOM         1       // incompressible bytes
+
+static void
+zs_fill(int *p, int pattern)
+{
+  uint64 x = 0x9e3779b97f4a7c15UL;
+  int i;
+
+  for(i = 0; i < PGSIZE / sizeof(int); i++){
+    if(pattern == ZS_RANDOM){
+      x ^= x << 13;
+      x ^= x >> 7;
+      x ^= x << 17;
+      p[i] = (int)x;
+    } else {
+      p[i] = (i / 64) % 11;
+    }
+  }
+}
+
+// Time ZS_NITER swap-out/swap-in round trips of one page through
+// ZONE_ZMEM: zstore() (compress or store raw) then zload().
+static uint64
+kbench_zstore(int pattern)
+{
+  char *page, *out;
+  void *z;
+  int i, half;
+  uint64 start, end;
+
+  if((page = kalloc(ZONE_FIXED)) == 0)
+    return -1;
+  if((out = kalloc(ZONE_FIXED)) == 0){
+    kfree(page, ZONE_FIXED);
+    return -1;
+  }
+  zs_fill((int*)page, pattern);
+
+  start = r_time();
+  for(i = 0; i < ZS_NITER; i++){
+    if((z = zstore((uint64)page, &half)) == 0)
+      break;
+    zload((uint64)z, out);
+    zfree(z, half ? ZHALF : ZFULL);
+  }
+  end = r_time();
+
+  if(i < ZS_NITER || memcmp(page, out, PGSIZE) != 0)
+    end = start - 1;
+  kfree(out, ZONE_FIXED);
+  kfree(page, ZONE_FIXED);
+  return end - start;
+}
+
+#ifdef PART3
+#define LZ_NITER          256     // timed compressions or decompressions
+#define LZ_BUF            (PGSIZE + PGSIZE / 16 + 128)
+
+static char lz_page[PGSIZE];
+static char lz_comp[LZ_BUF];
+static char lz_out[LZ_BUF];
+
+// Time LZ_NITER LZO compressions (or decompressions) of one page,
+// with interrupts off like zstore()/swapin().
+static uint64
+kbench_lzo(int pattern, int decompress)
+{
+  unsigned int clen = LZ_BUF, len;
+  uint64 start, end;
+  int i, err = 0;
+
+  zs_fill((int*)lz_page, pattern);
+  push_off();
+  lzo1x_compress((unsigned char*)lz_page, PGSIZE, (unsigned char*)lz_comp,
+                 &clen, (void*)WRKMEM_CPU(cpuid()));
+  pop_off();
+
+  start = r_time();
+  for(i = 0; i < LZ_NITER; i++){
+    push_off();
+    if(decompress){
+      len = PGSIZE;
+      err |= lzo1x_decompress((unsigned char*)lz_comp, clen,
+                              (unsigned char*)lz_out, &len);
+    } else {
+      len = LZ_BUF;
+      lzo1x_compress((unsigned char*)lz_page, PGSIZE, (unsigned char*)lz_out,
+                     &len, (void*)WRKMEM_CPU(cpuid()));
+    }
+    pop_off();
+  }
+  end = r_time();
+
+  if(decompress && (err || memcmp(lz_page, lz_out, PGSIZE) != 0))
+    end = start - 1;
+  return end - start;
+}
+#endif
+
+uint64
+sys_kbench(void)
+{
+  int test, arg;
+
+  argint(0, &test);
+  argint(1, &arg);
+
+  switch(test){
+  case KBENCH_ZFREE:
+    return kbench_zfree(arg);
+  case KBENCH_ZSTORE:
+    return kbench_zstore(arg);
+#ifdef PART3
+  case KBENCH_LZO_C:
+    return kbench_lzo(arg, 0);
+  case KBENCH_LZO_D:
+    return kbench_lzo(arg, 1);
+#endif
+  default:
+    return -1;
+  }
+}
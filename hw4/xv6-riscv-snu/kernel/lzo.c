@@ -69,6 +69,63 @@ typedef unsigned long   uintptr_t;
 #define COPY8(dst, src) \
         put_unaligned(get_unaligned((const u64 *)(src)), (u64 *)(dst))
 
+#ifdef LZO_RVV
+#include <riscv_vector.h>
+#define SSTATUS_VS    (3L << 9)
+#endif
+
+// Copy a literal run of n > 0 bytes between distinct buffers.
+// The word-at-a-time version copies 16 bytes per step and may
+// write up to 15 bytes past dst + n; callers leave that much room.
+// With LZO_RVV (make RVV=1) strips are copied with RVV loads and
+// stores instead. The vector unit is switched on only for the copy;
+// its registers are not saved, so callers must have interrupts off.
+// They are zeroed before it is switched off again, so that neither
+// user code nor the next copy can see another process's page.
+static inline void
+lzo_copy(unsigned char *dst, const unsigned char *src, size_t n)
+{
+#ifdef LZO_RVV
+	unsigned long x;
+	size_t vl;
+
+	asm volatile("csrr %0, sstatus" : "=r" (x));
+	asm volatile("csrw sstatus, %0" : : "r" (x | SSTATUS_VS));
+	for (; n > 0; n -= vl, src += vl, dst += vl) {
+		vl = __riscv_vsetvl_e8m8(n);
+		__riscv_vse8_v_u8m8(dst, __riscv_vle8_v_u8m8(src, vl), vl);
+	}
+	asm volatile("vsetvli t0, zero, e8, m8, ta, ma\n"
+	             "vmv.v.i v0, 0\n"
+	             "vmv.v.i v8, 0\n"
+	             "vmv.v.i v16, 0\n"
+	             "vmv.v.i v24, 0" : : : "t0", "memory");
+	asm volatile("csrw sstatus, %0" : : "r" (x));
+#else
+	do {
+		COPY8(dst, src);
+		COPY8(dst + 8, src + 8);
+		dst += 16;
+		src += 16;
+	} while (n > 16 && (n -= 16));
+#endif
+}
+
+// Expand a match at distance 1, 2 or 4 (runs of zeroes and of
+// small repeating patterns) 8 bytes at a time: once the first
+// 8 bytes are out the data repeats with period 8.
+// Writes up to 7 bytes past op + t.
+static inline void
+lzo_fill(unsigned char *op, const unsigned char *m_pos, size_t t)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		op[i] = m_pos[i];
+	for (i = 8; i < t; i += 8)
+		COPY8(op + i, op + i - 8);
+}
+
 // For LZO
 #define M1_MAX_OFFSET       0x0400
 #define M2_MAX_OFFSET       0x0800
@@ -252,16 +309,10 @@ next:
 					}
 					*op++ = tt;
 				}
-				do {
-					COPY8(op, ii);
-					COPY8(op + 8, ii + 8);
-					op += 16;
-					ii += 16;
-					t -= 16;
-				} while (t >= 16);
-				if (t > 0) do {
-					*op++ = *ii++;
-				} while (--t > 0);
+				// ip_end leaves 20 bytes of input
+				// after ii + t to read ahead into.
+				lzo_copy(op, ii, t);
+				op += t;
 			}
 		}
 
@@ -504,18 +555,9 @@ int lzo1x_decompress_safe(const unsigned char *in, size_t in_len,
 				t += 3;
 copy_literal_run:
 				if ((HAVE_IP(t + 15) && HAVE_OP(t + 15))) {
-					const unsigned char *ie = ip + t;
-					unsigned char *oe = op + t;
-					do {
-						COPY8(op, ip);
-						op += 8;
-						ip += 8;
-						COPY8(op, ip);
-						op += 8;
-						ip += 8;
-					} while (ip < ie);
-					ip = ie;
-					op = oe;
+					lzo_copy(op, ip, t);
+					ip += t;
+					op += t;
 				} else
 				{
 					NEED_OP(t);
@@ -644,6 +686,18 @@ copy_literal_run:
 					*op++ = *m_pos++;
 				} while (op < oe);
 			}
+		} else if (((op - m_pos) & 3) == 0 || op - m_pos <= 2) {
+			// distance 1, 2 or 4
+			NEED_OP(t);
+			if (HAVE_OP(t + 7)) {
+				lzo_fill(op, m_pos, t);
+				op += t;
+			} else {
+				unsigned char *oe = op + t;
+				do {
+					*op++ = *m_pos++;
+				} while (op < oe);
+			}
 		} else
 		{
 			unsigned char *oe = op + t;
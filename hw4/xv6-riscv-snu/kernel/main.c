@@ -19,6 +19,7 @@ main()
     kinit();         // physical page allocator
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
+    asidinit();      // address-space IDs
     procinit();      // process table
     trapinit();      // trap vectors
     trapinithart();  // install kernel trap vector
@@ -27,8 +28,13 @@ main()
     binit();         // buffer cache
     iinit();         // inode table
     fileinit();      // file table
+    shminit();       // shared memory segments
+    memcginit();     // memory groups
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
+    kswapdinit();    // background reclaim
+    kzerodinit();    // idle-time page zeroing
+    kscandinit();    // idle-page scanning and reclaim
     __sync_synchronize();
     started = 1;
   } else {
@@ -0,0 +1,178 @@
+//
+// Memory groups: resident-page limits for sets of processes.
+//
+// memcg() puts the calling process in a new group, and the children
+// it forks from then on join the group too. Every ZONE_NORMAL frame
+// is charged to the group of the process that allocated it, and the
+// charge moves to the new owner when swapout() hands the frame to
+// someone else. A group at its limit that needs a frame gets it by
+// evicting one of its own, so it cannot push the working sets of
+// other processes out to ZONE_ZMEM. Processes outside any group are
+// in group 0, which has no limit.
+//
+// A group's slot is reused once it has neither processes nor frames.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "pmstat.h"
+#include "xswap.h"
+
+struct memcg {
+  int nproc;                   // processes in the group
+  int limit;                   // resident pages, 0 for none
+  int resident;                // frames charged to the group
+  int nreclaim;                // frames it took back from itself
+};
+
+// memcg.lock guards nproc and limit; resident and nreclaim
+// change under kmem_normal.lock and are read racily here.
+struct {
+  struct spinlock lock;
+  struct memcg g[NMEMCG];
+} memcg;
+
+void
+memcginit(void)
+{
+  initlock(&memcg.lock, "memcg");
+}
+
+// fork() put a process in group g.
+void
+memcg_join(int g)
+{
+  if(g == 0)
+    return;
+  acquire(&memcg.lock);
+  memcg.g[g].nproc++;
+  release(&memcg.lock);
+}
+
+// A process of group g is gone.
+void
+memcg_leave(int g)
+{
+  if(g == 0)
+    return;
+  acquire(&memcg.lock);
+  memcg.g[g].nproc--;
+  release(&memcg.lock);
+}
+
+// Group to charge for a frame allocated now.
+int
+memcg_current(void)
+{
+  struct proc *p = myproc();
+
+  return p ? p->memcg : 0;
+}
+
+// Charge or uncharge a frame. kmem_normal.lock must be held.
+void
+memcg_charge(int g, int n)
+{
+  memcg.g[g].resident += n;
+}
+
+// Called by kalloc_normal() with kmem_normal.lock held when a
+// process of group g needs a frame. If g is at its limit, evict
+// one of g's own frames and return it, still charged to g.
+// Returns 0 if g may take a new frame, or has none to give back.
+// droplock is as for swapout_batch().
+void*
+memcg_reclaim(int g, int droplock)
+{
+  struct memcg *m = &memcg.g[g];
+  void *pa;
+
+  if(g == 0 || m->limit == 0 || m->resident < m->limit)
+    return 0;
+  if(swapout_memcg(&pa, 1, droplock, g) != 1)
+    return 0;
+  m->nreclaim++;
+  return pa;
+}
+
+// int memcg(int limit)
+// Move the calling process to a new group of at most limit
+// resident pages (0 for no limit). Returns the group's id.
+uint64
+sys_memcg(void)
+{
+  struct proc *p = myproc();
+  struct memcg *m;
+  int limit, g;
+
+  argint(0, &limit);
+  if(limit < 0)
+    return -1;
+  acquire(&memcg.lock);
+  for(g = 1; g < NMEMCG; g++){
+    m = &memcg.g[g];
+    if(m->nproc == 0 && m->resident == 0)
+      break;
+  }
+  if(g == NMEMCG){
+    release(&memcg.lock);
+    return -1;
+  }
+  m->nproc = 1;
+  m->limit = limit;
+  m->nreclaim = 0;
+  if(p->memcg != 0)
+    memcg.g[p->memcg].nproc--;
+  p->memcg = g;
+  release(&memcg.lock);
+  return g;
+}
+
+// int memcgstat(struct mcgstat *buf, int n)
+// Copy out one struct mcgstat per group in use, at most n,
+// group 0 first. Returns the number copied, or -1.
+uint64
+sys_memcgstat(void)
+{
+  struct mcgstat st;
+  uint64 buf;
+  int g, n, cnt = 0;
+
+  argaddr(0, &buf);
+  argint(1, &n);
+  for(g = 0; g < NMEMCG && cnt < n; g++){
+    acquire(&memcg.lock);
+    st.id = g;
+    st.nproc = memcg.g[g].nproc;
+    st.limit = memcg.g[g].limit;
+    st.resident = memcg.g[g].resident;
+    st.nreclaim = memcg.g[g].nreclaim;
+    release(&memcg.lock);
+    if(g != 0 && st.nproc == 0 && st.resident == 0)
+      continue;
+    if(copyout(myproc()->pagetable, buf + cnt*sizeof(st), (char *)&st, sizeof(st)) < 0)
+      return -1;
+    cnt++;
+  }
+  return cnt;
+}
+
+// Print the groups in use, for mallocstat().
+void
+memcgprint(void)
+{
+  struct memcg *m;
+
+  for(int g = 1; g < NMEMCG; g++){
+    m = &memcg.g[g];
+    if(m->nproc == 0 && m->resident == 0)
+      continue;
+    printf("memcg %d: nproc: %d, limit: %d, resident: %d, reclaim: %d\n",
+      g, m->nproc, m->limit, m->resident, m->nreclaim);
+  }
+}
@@ -42,7 +42,9 @@
 #define PHYSTOP       (NORMAL_START + (MEM)*4096)
 #define ZMEMSTOP      (PHYSTOP + (ZMEM)*4096)
 #ifdef PART3
-#define WRKMEM (NORMAL_START - 0x4000L)
+// per-CPU LZO compression work memory, right below ZONE_NORMAL
+#define WRKMEM (NORMAL_START - NCPU*0x4000L)
+#define WRKMEM_CPU(id) (WRKMEM + (id)*0x4000L)
 #endif
 
 
@@ -0,0 +1,458 @@
+//
+// mmap() and munmap() of files.
+//
+// A mapping is a struct vma in p->vma[], placed top-down below
+// TRAPFRAME; sbrk() may not grow into it. Nothing is mapped up
+// front: vmafault() reads each page in from the file when it is
+// first touched, like segfault() does for exec().
+//
+// A MAP_PRIVATE mapping gets frames of its own. MAP_SHARED ones
+// map the frames of the file's shared memory segment (v->shm as
+// well as v->f, see shm.c), so all processes that map a page see
+// each other's writes; the pages a process wrote are written back
+// at munmap() or exit(). PTE_D can't tell which those are, since
+// swapout() clears it and a page keeps its changes while
+// compressed, so the pages of a MAP_SHARED mapping start out
+// read-only and the first write fault marks them in v->dirty[].
+//
+// shmat() attaches shared memory segments as mappings too, with
+// only v->shm set.
+//
+// madvise() hints apply to mappings and to the heap alike.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "defs.h"
+#include "fs.h"
+#include "file.h"
+#include "fcntl.h"
+#include "xswap.h"
+
+extern void acquire_normal_lock();
+extern void release_normal_lock();
+extern void enqueue_head(uint64);
+extern struct spinlock *a_lock;
+
+#define DIRTYBIT(v, va)  (((va) - (v)->base) / PGSIZE)
+#define VMAUSED(v)       ((v)->f != 0 || (v)->shm != 0)
+
+// Return the mapping of p that overlaps [va, va+len), or 0.
+struct vma*
+vmafind(struct proc *p, uint64 va, uint64 len)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(VMAUSED(v) && va < v->va + v->len && v->va < va + len)
+      return v;
+  return 0;
+}
+
+// The lowest address mapped by mmap(), or TRAPFRAME.
+uint64
+vmabase(struct proc *p)
+{
+  struct vma *v;
+  uint64 base = TRAPFRAME;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(VMAUSED(v) && v->va < base)
+      base = v->va;
+  return base;
+}
+
+// Take a free mapping slot of p with len bytes of address space
+// below its lowest mapping. Returns it zeroed but for va, base
+// and len, or 0.
+struct vma*
+vmaalloc(struct proc *p, uint64 len)
+{
+  struct vma *v, *free = 0;
+  uint64 va;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(!VMAUSED(v) && free == 0)
+      free = v;
+  if(free == 0)
+    return 0;
+  len = PGROUNDUP(len);
+  va = vmabase(p) - len;
+  if(va < PGROUNDUP(p->sz))
+    return 0;
+  memset(free, 0, sizeof(*free));
+  free->va = free->base = va;
+  free->len = len;
+  return free;
+}
+
+// Read the page at va of mapping v into a new frame and map it.
+int
+vmafault(struct proc *p, struct vma *v, uint64 va)
+{
+  int perm = PTE_U | PTE_R;
+
+  if(v->shm)
+    return shmfault(p, v, va);
+  va = PGROUNDDOWN(va);
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+  if((v->prot & PROT_WRITE) && v->flags == MAP_PRIVATE)
+    perm |= PTE_W;
+  return uvmfilepage(p->pagetable, va, v->f->ip, v->off + (va - v->va),
+                     PGSIZE, perm);
+}
+
+// Handle a write to the read-only page at va of a writable
+// MAP_SHARED mapping: remember that it must be written back, and
+// let the write through. Returns -1 if va is no such page.
+int
+vmadirty(struct proc *p, uint64 va)
+{
+  struct vma *v;
+  pte_t *pte;
+  int held, r = -1;
+
+  va = PGROUNDDOWN(va);
+  if((v = vmafind(p, va, 1)) == 0 || v->f == 0 ||
+     (v->prot & PROT_WRITE) == 0 || v->flags != MAP_SHARED)
+    return -1;
+  held = holding(a_lock);
+  acquire_normal_lock();
+  if((pte = walk(p->pagetable, va, 0)) != 0 && (*pte & PTE_V) &&
+     (*pte & PTE_U) && (*pte & PTE_COW) == 0){
+    v->dirty[DIRTYBIT(v, va) / 64] |= 1UL << (DIRTYBIT(v, va) % 64);
+    *pte |= PTE_W | PTE_D;
+    sfence_vma_page(va);
+    r = 0;
+  }
+  if(!held)
+    release_normal_lock();
+  return r;
+}
+
+// Write the dirty pages of v in [va, va+len) back to the file,
+// without growing it.
+static int
+vmawriteback(struct proc *p, struct vma *v, uint64 va, uint64 len)
+{
+  struct inode *ip = v->f->ip;
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  uint64 a, off;
+  pte_t *pte;
+  char *buf;
+  int i, n, r = 0;
+
+  if((buf = kalloc(ZONE_FIXED)) == 0)
+    return -1;
+  for(a = va; a < va + len && r == 0; a += PGSIZE){
+    if((v->dirty[DIRTYBIT(v, a) / 64] & (1UL << (DIRTYBIT(v, a) % 64))) == 0)
+      continue;
+    if((pte = walk(p->pagetable, a, 0)) == 0)
+      continue;
+    if((*pte & PTE_SD) && zreadback(p->pagetable, a) < 0){
+      r = -1;
+      break;
+    }
+    acquire_normal_lock();
+    if((*pte & PTE_V) == 0 && (*pte & PTE_S))
+      swapin(p->pagetable, a);
+    if((*pte & PTE_V) == 0){
+      release_normal_lock();
+      continue;
+    }
+    memmove(buf, (char*)PTE2PA(*pte), PGSIZE);
+    release_normal_lock();
+
+    off = v->off + (a - v->va);
+    for(i = 0; i < PGSIZE; i += n){
+      n = PGSIZE - i < max ? PGSIZE - i : max;
+      begin_op();
+      ilock(ip);
+      if(off + i >= ip->size)
+        n = 0;
+      else if(off + i + n > ip->size)
+        n = ip->size - (off + i);
+      if(n > 0 && writei(ip, 0, (uint64)buf + i, off + i, n) != n)
+        r = -1;
+      iunlock(ip);
+      end_op();
+      if(n == 0 || r < 0)
+        break;
+    }
+  }
+  kfree(buf, ZONE_FIXED);
+  return r;
+}
+
+// Unmap [va, va+len) of v, a prefix, a suffix or all of it,
+// writing back what was written to a MAP_SHARED file mapping.
+int
+vmaunmap(struct proc *p, struct vma *v, uint64 va, uint64 len)
+{
+  int r = 0;
+
+  if(v->f && v->flags == MAP_SHARED && (v->prot & PROT_WRITE))
+    r = vmawriteback(p, v, va, len);
+  uvmunmap(p->pagetable, va, len / PGSIZE, 1);
+  if(va == v->va){
+    v->va += len;
+    v->off += len;
+  }
+  v->len -= len;
+  if(v->len == 0){
+    if(v->shm)
+      shmput(v->shm);
+    if(v->f)
+      fileclose(v->f);
+    v->f = 0;
+    v->shm = 0;
+  }
+  return r;
+}
+
+// Unmap all of p's mappings, for exit() and exec().
+void
+vmafree(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(VMAUSED(v))
+      vmaunmap(p, v, v->va, v->len);
+}
+
+// Give fork()'s child np p's mappings. MAP_PRIVATE file pages are
+// shared as uvmcopy() shares the rest of memory; the child faults
+// in the pages of a shared memory segment, or of a MAP_SHARED file
+// mapping, from the segment.
+int
+vmacopy(struct proc *p, struct proc *np)
+{
+  int i;
+
+  for(i = 0; i < NVMA; i++){
+    if(!VMAUSED(&p->vma[i]))
+      continue;
+    if(p->vma[i].shm){
+      np->vma[i] = p->vma[i];
+      shmdup(np->vma[i].shm);
+      if(np->vma[i].f)
+        filedup(np->vma[i].f);
+      continue;
+    }
+    if(uvmcopy(p->pagetable, np->pagetable, p->vma[i].va, p->vma[i].len) < 0)
+      goto bad;
+    np->vma[i] = p->vma[i];
+    filedup(np->vma[i].f);
+  }
+  return 0;
+
+ bad:
+  for(i = 0; i < NVMA; i++){
+    if(np->vma[i].shm){
+      shmput(np->vma[i].shm);
+      np->vma[i].shm = 0;
+    } else if(np->vma[i].f){
+      uvmunmap(np->pagetable, np->vma[i].va, np->vma[i].len / PGSIZE, 1);
+    }
+    if(np->vma[i].f){
+      fileclose(np->vma[i].f);
+      np->vma[i].f = 0;
+    }
+  }
+  return -1;
+}
+
+// void *mmap(void *addr, int len, int prot, int flags, int fd, int off)
+// addr must be 0; the kernel picks the address. MAP_SHARED fails
+// when the file has no segment and none is free.
+uint64
+sys_mmap(void)
+{
+  struct proc *p = myproc();
+  struct shm *s = 0;
+  struct vma *v;
+  struct file *f;
+  uint64 addr;
+  int len, prot, flags, fd, off;
+
+  argaddr(0, &addr);
+  argint(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argint(4, &fd);
+  argint(5, &off);
+  if(fd < 0 || fd >= NOFILE || (f = p->ofile[fd]) == 0)
+    return -1;
+  if(addr != 0 || len <= 0 || len > MAXMMAP * PGSIZE || off < 0 || off % PGSIZE)
+    return -1;
+  if(f->type != FD_INODE || !f->readable)
+    return -1;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
+  if((prot & PROT_WRITE) && flags == MAP_SHARED && !f->writable)
+    return -1;
+
+  if(flags == MAP_SHARED &&
+     (s = shmfile(f->ip, PGROUNDUP(off + len) / PGSIZE)) == 0)
+    return -1;
+  if((v = vmaalloc(p, len)) == 0){
+    if(s)
+      shmput(s);
+    return -1;
+  }
+  v->shm = s;
+  v->f = filedup(f);
+  v->off = off;
+  v->prot = prot;
+  v->flags = flags;
+  return v->va;
+}
+
+// int munmap(void *addr, int len)
+// Unmaps a prefix, a suffix or the whole of one mapping.
+uint64
+sys_munmap(void)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 addr;
+  int len;
+
+  argaddr(0, &addr);
+  argint(1, &len);
+  if(addr % PGSIZE || len <= 0)
+    return -1;
+  len = PGROUNDUP(len);
+  if((v = vmafind(p, addr, len)) == 0 || v->f == 0)
+    return -1;
+  if(addr < v->va || addr + len > v->va + v->len)
+    return -1;
+  if(addr != v->va && addr + len != v->va + v->len)
+    return -1;
+  return vmaunmap(p, v, addr, len);
+}
+
+// MADV_DONTNEED: drop the pages of [va, va+len), resident or
+// swapped, writing back those of a MAP_SHARED file mapping first.
+// The next touch zero-fills them, or reads them from the file.
+// Returns -1, and drops nothing, if the writeback fails.
+static int
+madvdontneed(struct proc *p, struct vma *v, uint64 va, uint64 len)
+{
+  uint64 a, b;
+  pte_t *pte;
+
+  if(v && v->f && v->flags == MAP_SHARED && (v->prot & PROT_WRITE)){
+    if(vmawriteback(p, v, va, len) < 0)
+      return -1;
+    for(a = va; a < va + len; a += PGSIZE)
+      v->dirty[DIRTYBIT(v, a) / 64] &= ~(1UL << (DIRTYBIT(v, a) % 64));
+  }
+  for(a = va; a < va + len; a = b + PGSIZE){
+    // leave the stack guard page, which has no PTE_U
+    for(b = a; b < va + len; b += PGSIZE){
+      if(walkmega(p->pagetable, b) == 0 && (pte = walk(p->pagetable, b, 0)) != 0 &&
+         (*pte & (PTE_V | PTE_S)) && (*pte & PTE_U) == 0)
+        break;
+    }
+    if(b > a)
+      uvmunmap(p->pagetable, a, (b - a) / PGSIZE, 1);
+  }
+  return 0;
+}
+
+// MADV_WILLNEED: swap in the compressed and on-disk pages of
+// [va, va+len) now, as long as that takes no frames kswapd would
+// have to reclaim.
+static void
+madvwillneed(struct proc *p, uint64 va, uint64 len)
+{
+  uint64 a;
+  pte_t *pte;
+
+  // disk reads sleep, so bring those into ZONE_ZMEM first.
+  for(a = va; a < va + len; a += PGSIZE)
+    zreadback(p->pagetable, a);
+  acquire_normal_lock();
+  for(a = va; a < va + len && MEM - nalloc4k > KSWAPD_LOW; a += PGSIZE){
+    if(walkmega(p->pagetable, a) || (pte = walk(p->pagetable, a, 0)) == 0)
+      continue;
+    if((*pte & PTE_S) && (*pte & (PTE_V | PTE_SD)) == 0)
+      swapin(p->pagetable, a);
+  }
+  release_normal_lock();
+}
+
+// p just faulted in the page at va. Under MADV_SEQUENTIAL the one
+// before it has been read and won't be again soon, so make it the
+// next page swapout() takes.
+void
+madvfault(struct proc *p, uint64 va)
+{
+  pte_t *pte;
+  int held;
+
+  va = PGROUNDDOWN(va);
+  if(va < p->madv_start + PGSIZE || va >= p->madv_end)
+    return;
+  va -= PGSIZE;
+  held = holding(a_lock);
+  acquire_normal_lock();
+  if(walkmega(p->pagetable, va) == 0 && (pte = walk(p->pagetable, va, 0)) != 0 &&
+     (*pte & PTE_V) && PTE2PA(*pte) >= NORMAL_START && PTE2PA(*pte) < PHYSTOP)
+    enqueue_head(PTE2PA(*pte));
+  if(!held)
+    release_normal_lock();
+}
+
+// int madvise(void *addr, int len, int advice)
+// [addr, addr+len) must lie in the heap or in one mapping.
+// MADV_SEQUENTIAL covers one range per process; MADV_NORMAL
+// clears it.
+uint64
+sys_madvise(void)
+{
+  struct proc *p = myproc();
+  struct vma *v = 0;
+  uint64 addr;
+  int len, advice;
+
+  argaddr(0, &addr);
+  argint(1, &len);
+  argint(2, &advice);
+  if(addr % PGSIZE || len <= 0)
+    return -1;
+  len = PGROUNDUP(len);
+  if(addr + len > p->sz){
+    if((v = vmafind(p, addr, len)) == 0 || addr < v->va ||
+       addr + len > v->va + v->len)
+      return -1;
+  }
+
+  switch(advice){
+  case MADV_NORMAL:
+    p->madv_start = p->madv_end = 0;
+    break;
+  case MADV_SEQUENTIAL:
+    p->madv_start = addr;
+    p->madv_end = addr + len;
+    break;
+  case MADV_WILLNEED:
+    madvwillneed(p, addr, len);
+    break;
+  case MADV_DONTNEED:
+    if(madvdontneed(p, v, addr, len) < 0)
+      return -1;
+    break;
+  default:
+    return -1;
+  }
+  return 0;
+}
@@ -11,5 +11,14 @@
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
-#define USERSTACK    1     // user stack pages
+#define USERSTACK    1     // user stack pages mapped by exec()
+#define STACKDEF     64    // default RLIMIT_STACK in pages
+#define STACKMAX     1024  // max RLIMIT_STACK in pages
+#define NSWAPLAT     12    // swap-in latency histogram bins, see pmstat.h
+#define NSEG         4     // demand-paged program segments per process
+#define NVMA         8     // mmap() mappings per process
+#define NRLIMIT      1     // setrlimit() resources, see resource.h
+#define MAXMMAP      256   // max pages per mmap() or shared memory segment
+#define NSHM         16    // shared memory segments per system
+#define NMEMCG       8     // memory groups per system, with group 0
 
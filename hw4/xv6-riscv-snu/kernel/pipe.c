@@ -81,6 +81,8 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
   int i = 0;
   struct proc *pr = myproc();
 
+  // copyin() below runs under pi->lock and cannot wait for the disk.
+  zreadback_range(pr->pagetable, addr, n);
   acquire(&pi->lock);
   while(i < n){
     if(pi->readopen == 0 || killed(pr)){
@@ -111,6 +113,7 @@ piperead(struct pipe *pi, uint64 addr, int n)
   struct proc *pr = myproc();
   char ch;
 
+  zreadback_range(pr->pagetable, addr, n);
   acquire(&pi->lock);
   while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
     if(killed(pr)){
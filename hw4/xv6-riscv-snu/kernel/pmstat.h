@@ -0,0 +1,36 @@
+// Per-process memory statistics, returned by pmemstat().
+
+// swap-in fault latency histogram: bin 0 counts faults shorter
+// than 2^PMSTAT_LAT0 r_time() ticks, bin i those shorter than
+// 2^(PMSTAT_LAT0+i), and the last bin everything longer.
+#define PMSTAT_LAT0   6
+
+struct pmstat {
+  int pid;
+  char name[16];
+  int resident;       // pages mapped in ZONE_NORMAL
+  int half;           // pages in 2KB ZONE_ZMEM objects
+  int full;           // pages in 4KB ZONE_ZMEM objects
+  int disk;           // pages on the swap disk
+  uint64 zbytes;      // bytes of ZONE_ZMEM objects' contents
+  int nswapin;        // swap-in faults
+  uint lat[NSWAPLAT]; // their latency histogram
+  int memcg;          // memory group, see memcg()
+};
+
+// Same-page merging counters, returned by ksmstat() (make KSM=1).
+struct ksmstat {
+  int nscan;          // frames ksm_scan() looked at
+  int nmerge;         // frames it merged into others
+  int sharing;        // frames the merged pages save now
+  int scanms;         // time spent scanning, in ms
+};
+
+// Per memory group counters, returned by memcgstat().
+struct mcgstat {
+  int id;
+  int nproc;          // processes in the group (not counted for 0)
+  int limit;          // resident page limit, 0 for none
+  int resident;       // ZONE_NORMAL frames charged to the group
+  int nreclaim;       // frames it evicted from itself at its limit
+};
@@ -5,6 +5,7 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "resource.h"
 #include "xswap.h"
 
 struct cpu cpus[NCPU];
@@ -17,6 +18,7 @@ int nextpid = 1;
 struct spinlock pid_lock;
 
 extern void forkret(void);
+static void kprocret(void);
 static void freeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
@@ -169,6 +171,20 @@ freeproc(struct proc *p)
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->kfn = 0;
+  p->ra_next = p->ra_start = p->ra_mask = 0;
+  p->ra_win = 0;
+  p->nswapin = 0;
+  memset(p->swapin_lat, 0, sizeof(p->swapin_lat));
+  memset(p->seg, 0, sizeof(p->seg));
+  memset(p->vma, 0, sizeof(p->vma));
+  p->madv_start = p->madv_end = 0;
+  p->stacklim = p->stacktop = 0;
+  memset(p->rlim, 0, sizeof(p->rlim));
+  memcg_leave(p->memcg);
+  p->memcg = 0;
+  p->asid = 0;
+  p->asidgen = 0;
   p->state = UNUSED;
 }
 
@@ -246,6 +262,7 @@ userinit(void)
   // prepare for the very first "return" from kernel to user.
   p->trapframe->epc = 0;      // user program counter
   p->trapframe->sp = PGSIZE;  // user stack pointer
+  p->rlim[RLIMIT_STACK] = STACKDEF * PGSIZE;
 
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
@@ -255,6 +272,23 @@ userinit(void)
   release(&p->lock);
 }
 
+// Create a kernel process that runs fn() in supervisor mode.
+// It has no user memory and never returns to user space.
+struct proc*
+kproc(void (*fn)(void), char *name)
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kproc");
+  p->kfn = fn;
+  p->context.ra = (uint64)kprocret;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->state = RUNNABLE;
+  release(&p->lock);
+  return p;
+}
+
 // Grow or shrink user memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
@@ -265,9 +299,11 @@ growproc(int n)
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    // only reserve the address space; uvmlazy() gives each
+    // page a frame when it is first touched.
+    if(sz + n > vmabase(p))
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
     sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
@@ -289,12 +325,24 @@ fork(void)
     return -1;
   }
   // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  if(uvmcopy(p->pagetable, np->pagetable, 0, p->sz) < 0){
     freeproc(np);
     release(&np->lock);
     return -1;
   }
   np->sz = p->sz;
+  np->madv_start = p->madv_start;
+  np->madv_end = p->madv_end;
+  np->stacklim = p->stacklim;
+  np->stacktop = p->stacktop;
+  memmove(np->rlim, p->rlim, sizeof(p->rlim));
+  np->memcg = p->memcg;
+  memcg_join(np->memcg);
+  if(vmacopy(p, np) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -307,6 +355,11 @@ fork(void)
     if(p->ofile[i])
       np->ofile[i] = filedup(p->ofile[i]);
   np->cwd = idup(p->cwd);
+  for(i = 0; i < NSEG; i++){
+    np->seg[i] = p->seg[i];
+    if(np->seg[i].ip)
+      idup(np->seg[i].ip);
+  }
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
@@ -351,6 +404,9 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  // Write back and drop file mappings while the files are open.
+  vmafree(p);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -362,6 +418,7 @@ exit(int status)
 
   begin_op();
   iput(p->cwd);
+  segput(p->seg);
   end_op();
   p->cwd = 0;
 
@@ -394,6 +451,9 @@ wait(uint64 addr)
   int havekids, pid;
   struct proc *p = myproc();
 
+  // the exit status is copied out under wait_lock.
+  if(addr != 0)
+    zreadback_range(p->pagetable, addr, sizeof(int));
   acquire(&wait_lock);
 
   for(;;){
@@ -482,7 +542,10 @@ scheduler(void)
       release(&p->lock);
     }
     if(found == 0) {
-      // nothing to run; stop running on this core until an interrupt.
+      // nothing to run; zero free pages, scan for idle ones, or
+      // stop running on this core until an interrupt.
+      if(kzero_idle() || kscan_idle())
+        continue;
       intr_on();
       asm volatile("wfi");
     }
@@ -560,6 +623,17 @@ forkret(void)
   usertrapret();
 }
 
+// A kernel process's very first scheduling will swtch here.
+static void
+kprocret(void)
+{
+  // Still holding p->lock from scheduler.
+  release(&myproc()->lock);
+
+  myproc()->kfn();
+  panic("kprocret");
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
@@ -609,6 +683,19 @@ wakeup(void *chan)
   }
 }
 
+// Wake up p alone if it is sleeping on chan, without
+// scanning (and locking) the whole process table.
+void
+wakeproc(struct proc *p, void *chan)
+{
+  if(p == myproc())
+    return;
+  acquire(&p->lock);
+  if(p->state == SLEEPING && p->chan == chan)
+    p->state = RUNNABLE;
+  release(&p->lock);
+}
+
 // Kill the process with the given pid.
 // The victim won't exit until it tries to return
 // to user space (see usertrap() in trap.c).
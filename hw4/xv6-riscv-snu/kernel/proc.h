@@ -24,6 +24,9 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint asidgen;               // ASID generation of the last full TLB flush
+  uint tlbepoch;              // tlbepoch as of the last full TLB flush
+  int inuser;                 // running user code, see uvmflush_wait()
 };
 
 extern struct cpu cpus[NCPU];
@@ -77,10 +80,36 @@ struct trapframe {
   /* 264 */ uint64 t4;
   /* 272 */ uint64 t5;
   /* 280 */ uint64 t6;
+  /* 288 */ uint64 tlbflush;      // uservec flushes the TLB (no ASIDs)
 };
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A program segment exec() left to be read in page by page
+// on first touch; see segfault().
+struct seg {
+  struct inode *ip;            // 0 if the slot is unused
+  uint64 va;                   // start, page-aligned
+  uint64 memsz;                // bytes from va
+  uint64 off;                  // offset of va in ip
+  uint64 filesz;               // bytes from va that come from ip
+  int perm;                    // PTE bits
+};
+
+// A file mapping made by mmap(), or a shared memory segment
+// attached by shmat(); see mmap.c.
+struct vma {
+  struct file *f;              // the file, or 0
+  struct shm *shm;             // the segment, or 0; unused if both are
+  uint64 va;                   // start, page-aligned
+  uint64 len;                  // bytes, page-aligned
+  uint64 off;                  // offset of va in the file
+  uint64 base;                 // va as first mapped, for dirty[]
+  int prot;                    // PROT_*
+  int flags;                   // MAP_SHARED or MAP_PRIVATE
+  uint64 dirty[MAXMMAP / 64];  // MAP_SHARED pages written to
+};
+
 // Per-process state
 struct proc {
   struct spinlock lock;
@@ -103,8 +132,36 @@ struct proc {
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct seg seg[NSEG];        // Program segments not yet paged in
+  struct vma vma[NVMA];        // mmap() mappings
   
   struct cpu* c;
+  void (*kfn)(void);           // Body of a kernel process, see kproc()
+
+  // swap readahead state, see swapin_readahead()
+  uint64 ra_next;              // page a sequential fault would hit next
+  uint64 ra_start;             // first page of the last readahead window
+  uint64 ra_mask;              // pages in that window we swapped in
+  int ra_win;                  // current window size in pages (0 = off)
+
+  // swap-in faults, see pmemstat()
+  int nswapin;
+  uint swapin_lat[NSWAPLAT];
+
+  // the user stack grows down from stacktop to stacklim, see vmfault()
+  uint64 stacklim;
+  uint64 stacktop;
+  uint64 rlim[NRLIMIT];        // see setrlimit()
+
+  // pages under MADV_SEQUENTIAL, see madvfault()
+  uint64 madv_start;
+  uint64 madv_end;
+
+  int memcg;                   // memory group, see memcg.c
+
+  // address-space ID, see uvmsatp()
+  int asid;
+  uint asidgen;                // 0 until an ASID is allocated
   
   char name[16];               // Process name (debugging)
 };
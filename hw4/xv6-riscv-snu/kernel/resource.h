@@ -0,0 +1,3 @@
+// Per-process resource limits, see setrlimit(). NRLIMIT is in param.h.
+
+#define RLIMIT_STACK  0   // bytes the user stack may grow to, from exec()
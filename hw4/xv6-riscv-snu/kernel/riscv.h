@@ -222,6 +222,10 @@ w_pmpaddr0(uint64 x)
 
 #define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64)pagetable) >> 12))
 
+// the address-space ID field of satp; TLB entries are tagged with it.
+#define SATP_ASID(asid) (((uint64)(asid) & 0xFFFF) << 44)
+#define ASIDOF(satp) (((satp) >> 44) & 0xFFFF)
+
 // supervisor address translation and protection;
 // holds the address of the page table.
 static inline void 
@@ -353,14 +357,20 @@ typedef uint64 *pagetable_t; // 512 PTEs
 #define PGROUNDUP(sz)  (((sz)+PGSIZE-1) & ~(PGSIZE-1))
 #define PGROUNDDOWN(a) (((a)) & ~(PGSIZE-1))
 
+#define MEGAPGSIZE (PGSIZE * 512) // bytes per megapage (level-1 leaf)
+
 #define PTE_V (1L << 0) // valid
 #define PTE_R (1L << 1)
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // user can access
+#define PTE_A (1L << 6) // accessed
+#define PTE_D (1L << 7) // dirty
 
 #define PTE_S (1L << 8)
 #define PTE_H (1L << 9)
+#define PTE_SD (1L << 5) // swapped page is in a disk slot (G, only when !V)
+#define PTE_COW (1L << 9) // copy-on-write (same bit as PTE_H, only when V)
 
 #define HPGSIZE 2048
 #define HPGSHIFT 11
@@ -0,0 +1,285 @@
+//
+// Shared memory segments: shmget(), shmat() and shmdt().
+//
+// A segment's pages belong to a page table of its own, which is
+// never loaded into satp, and each process that attaches the segment
+// maps the same frames in a struct vma. A frame thus has one rmap
+// entry per attached mapper plus one for the segment, so swapout()
+// reclaims it like any shared page and swapin() maps it back into
+// all of them. Nothing is allocated up front: shmfault() takes the
+// page from the segment's table, or zero-fills it there, when a
+// process first touches it.
+//
+// A segment is freed when the last process detaches it; one that
+// was never attached stays until it is.
+//
+// MAP_SHARED mmap()s of a file use a segment too, one per inode,
+// whose table holds the file's pages at their file offsets; they
+// are read in from the file instead of zero-filled. Every process
+// that maps a page of the file thus maps the same frame, and sees
+// the others' writes at once. Such a segment has no key, so
+// shmget() never finds it, and goes away with its last mapping.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "fcntl.h"
+#include "xswap.h"
+
+extern void acquire_normal_lock();
+extern void release_normal_lock();
+
+struct shm {
+  int key;                     // 0 for a private segment
+  int npages;                  // 0 if the slot is unused
+  int nattach;                 // vmas that map it
+  pagetable_t pagetable;       // its pages, from va 0
+  struct inode *ip;            // file of a MAP_SHARED mmap(), or 0
+};
+
+struct {
+  struct spinlock lock;
+  struct shm seg[NSHM];
+} shmtab;
+
+void
+shminit(void)
+{
+  initlock(&shmtab.lock, "shm");
+}
+
+// Read the page at off of s's file into mem, zeros past its end.
+// Sleeps, so kmem_normal.lock must not be held; swapout() leaves
+// mem alone until it is mapped.
+static int
+shmread(struct shm *s, char *mem, uint64 off)
+{
+  int r;
+
+  ilock(s->ip);
+  r = readi(s->ip, 0, (uint64)mem, off, PGSIZE);
+  iunlock(s->ip);
+  return r < 0 ? -1 : 0;
+}
+
+// Map the page at va of p's attachment v, bringing it into the
+// segment first if no one has touched it or it was swapped out.
+// A file's page is mapped read-only unless written, so that
+// vmadirty() sees the first write.
+int
+shmfault(struct proc *p, struct vma *v, uint64 va)
+{
+  struct shm *s = v->shm;
+  int perm = PTE_U | PTE_R | PTE_W;
+  uint64 off;
+  pte_t *spte;
+  char *mem;
+
+  va = PGROUNDDOWN(va);
+  off = v->off + (va - v->va);
+  if(s->ip){
+    perm = PTE_U | PTE_R;
+    if(v->prot & PROT_EXEC)
+      perm |= PTE_X;
+  }
+ again:
+  for(;;){
+    if(zreadback(s->pagetable, off) < 0)
+      return -1;
+    acquire_normal_lock();
+    if((spte = walk(s->pagetable, off, 1)) == 0)
+      goto bad;
+    if((*spte & PTE_SD) == 0)
+      break;
+    // written back again while the lock was dropped
+    release_normal_lock();
+  }
+  if((*spte & PTE_V) == 0 && (*spte & PTE_S) &&
+     swapin(s->pagetable, off) == 0)
+    goto bad;
+  if((*spte & PTE_V) == 0){
+    if((mem = kalloc_zeroed()) == 0)
+      goto bad;
+    if(s->ip){
+      release_normal_lock();
+      if(shmread(s, mem, off) < 0){
+        acquire_normal_lock();
+        kfree(mem, ZONE_NORMAL);
+        goto bad;
+      }
+      acquire_normal_lock();
+      if((spte = walk(s->pagetable, off, 1)) == 0 || (*spte & (PTE_V | PTE_S))){
+        // another mapper brought it in meanwhile
+        kfree(mem, ZONE_NORMAL);
+        if(spte == 0)
+          goto bad;
+        release_normal_lock();
+        goto again;
+      }
+    }
+    *spte = PA2PTE(mem) | PTE_R | PTE_W | PTE_V;
+    rmap_add((uint64)mem, s->pagetable, off);
+  }
+  if(mappages(p->pagetable, va, PGSIZE, PTE2PA(*spte), perm) != 0)
+    goto bad;
+  release_normal_lock();
+  return 0;
+
+ bad:
+  release_normal_lock();
+  return -1;
+}
+
+// fork() gave a child p's attachment of s.
+void
+shmdup(struct shm *s)
+{
+  acquire(&shmtab.lock);
+  s->nattach++;
+  release(&shmtab.lock);
+}
+
+// Return ip's segment for a MAP_SHARED mmap() of its first npages
+// pages, creating it if there is none, with the mapping attached.
+// Returns 0 if all segments are in use.
+struct shm*
+shmfile(struct inode *ip, int npages)
+{
+  struct shm *s, *free = 0;
+
+  acquire(&shmtab.lock);
+  for(s = shmtab.seg; s < &shmtab.seg[NSHM]; s++){
+    if(s->npages == 0){
+      if(free == 0)
+        free = s;
+    } else if(s->ip == ip){
+      break;
+    }
+  }
+  if(s == &shmtab.seg[NSHM]){
+    if((s = free) == 0 || (s->pagetable = uvmcreate()) == 0){
+      release(&shmtab.lock);
+      return 0;
+    }
+    s->key = 0;
+    s->npages = 0;
+    s->nattach = 0;
+    s->ip = idup(ip);
+  }
+  if(npages > s->npages)
+    s->npages = npages;
+  s->nattach++;
+  release(&shmtab.lock);
+  return s;
+}
+
+// An attachment of s is gone; free s with the last one.
+void
+shmput(struct shm *s)
+{
+  pagetable_t pagetable;
+  struct inode *ip;
+  int npages;
+
+  acquire(&shmtab.lock);
+  if(--s->nattach > 0){
+    release(&shmtab.lock);
+    return;
+  }
+  pagetable = s->pagetable;
+  npages = s->npages;
+  ip = s->ip;
+  s->pagetable = 0;
+  s->npages = 0;
+  s->key = 0;
+  s->ip = 0;
+  release(&shmtab.lock);
+  uvmfree(pagetable, npages * PGSIZE);
+  if(ip){
+    begin_op();
+    iput(ip);
+    end_op();
+  }
+}
+
+// int shmget(int key, int size)
+// Returns the id of the segment named key, creating it with size
+// bytes if there is none. Key 0 always creates a new segment.
+uint64
+sys_shmget(void)
+{
+  struct shm *s, *free = 0;
+  int key, size, id;
+
+  argint(0, &key);
+  argint(1, &size);
+  if(size <= 0 || size > MAXMMAP * PGSIZE)
+    return -1;
+
+  acquire(&shmtab.lock);
+  for(s = shmtab.seg; s < &shmtab.seg[NSHM]; s++){
+    if(s->npages == 0){
+      if(free == 0)
+        free = s;
+    } else if(key != 0 && s->key == key){
+      id = (size <= s->npages * PGSIZE) ? s - shmtab.seg : -1;
+      release(&shmtab.lock);
+      return id;
+    }
+  }
+  if((s = free) == 0 || (s->pagetable = uvmcreate()) == 0){
+    release(&shmtab.lock);
+    return -1;
+  }
+  s->key = key;
+  s->npages = PGROUNDUP(size) / PGSIZE;
+  s->nattach = 0;
+  release(&shmtab.lock);
+  return s - shmtab.seg;
+}
+
+// void *shmat(int id)
+// The kernel picks the address, as for mmap().
+uint64
+sys_shmat(void)
+{
+  struct proc *p = myproc();
+  struct shm *s;
+  struct vma *v;
+  int id;
+
+  argint(0, &id);
+  if(id < 0 || id >= NSHM)
+    return -1;
+  s = &shmtab.seg[id];
+  acquire(&shmtab.lock);
+  if(s->npages == 0 || (v = vmaalloc(p, s->npages * PGSIZE)) == 0){
+    release(&shmtab.lock);
+    return -1;
+  }
+  s->nattach++;
+  release(&shmtab.lock);
+  v->shm = s;
+  v->prot = PROT_READ | PROT_WRITE;
+  v->flags = MAP_SHARED;
+  return v->va;
+}
+
+// int shmdt(void *addr)
+uint64
+sys_shmdt(void)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 addr;
+
+  argaddr(0, &addr);
+  if((v = vmafind(p, addr, 1)) == 0 || v->shm == 0 || v->f != 0 || v->va != addr)
+    return -1;
+  return vmaunmap(p, v, v->va, v->len);
+}
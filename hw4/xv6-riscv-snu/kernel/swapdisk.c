@@ -0,0 +1,138 @@
+//
+// Swap slots on the virtio disk, used as the second tier behind
+// ZONE_ZMEM.  The swap area starts right after the file system
+// (block FSSIZE) and holds SWAP slots of one page each.  A slot
+// stores one compressed (or raw) page exactly as it was kept in
+// ZONE_ZMEM, so only the blocks that hold data are transferred.
+//
+// Slots are reference counted so that fork() can share a page
+// that is on disk without reading it back.
+//
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "buf.h"
+#include "xswap.h"
+
+#define SWAPSTART   FSSIZE              // first block of the swap area
+#define SLOTBLOCKS  (PGSIZE / BSIZE)    // blocks per slot
+
+struct {
+  struct spinlock lock;
+  ushort ref[SWAP];   // number of PTEs naming each slot
+  short len[SWAP];    // bytes stored in each slot
+  int hint;           // where to start the next search
+} swapdisk;
+
+int nswapslot;        // slots in use
+
+void
+swapdisk_init(void)
+{
+  initlock(&swapdisk.lock, "swapdisk");
+  nswapslot = 0;
+  swapdisk.hint = 0;
+}
+
+// Allocate a free slot with a reference count of one.
+// Returns the slot number, or -1 if the swap area is full.
+int
+swap_alloc(void)
+{
+  int i, slot;
+
+  acquire(&swapdisk.lock);
+  for(i = 0; i < SWAP; i++){
+    slot = (swapdisk.hint + i) % SWAP;
+    if(swapdisk.ref[slot] == 0){
+      swapdisk.ref[slot] = 1;
+      swapdisk.len[slot] = 0;
+      swapdisk.hint = (slot + 1) % SWAP;
+      nswapslot++;
+      release(&swapdisk.lock);
+      return slot;
+    }
+  }
+  release(&swapdisk.lock);
+  return -1;
+}
+
+void
+swap_dup(int slot)
+{
+  if(slot < 0 || slot >= SWAP)
+    panic("swap_dup");
+  acquire(&swapdisk.lock);
+  if(swapdisk.ref[slot] == 0 || swapdisk.ref[slot] == 0xffff)
+    panic("swap_dup: ref");
+  swapdisk.ref[slot]++;
+  release(&swapdisk.lock);
+}
+
+// Drop one reference to slot; the slot is freed on the last one.
+void
+swap_put(int slot)
+{
+  if(slot < 0 || slot >= SWAP)
+    panic("swap_put");
+  acquire(&swapdisk.lock);
+  if(swapdisk.ref[slot] == 0)
+    panic("swap_put: ref");
+  if(--swapdisk.ref[slot] == 0)
+    nswapslot--;
+  release(&swapdisk.lock);
+}
+
+// Write len bytes at src to slot. May sleep.
+void
+swap_write(int slot, char *src, int len)
+{
+  struct buf *b;
+  int i, n;
+
+  if(len <= 0 || len > PGSIZE)
+    panic("swap_write");
+  for(i = 0; i * BSIZE < len; i++){
+    n = len - i * BSIZE;
+    if(n > BSIZE)
+      n = BSIZE;
+    // the whole block is overwritten, so don't read it first
+    b = bgetw(ROOTDEV, SWAPSTART + slot * SLOTBLOCKS + i);
+    memmove(b->data, src + i * BSIZE, n);
+    memset(b->data + n, 0, BSIZE - n);
+    bwrite(b);
+    brelse(b);
+  }
+  acquire(&swapdisk.lock);
+  swapdisk.len[slot] = len;
+  release(&swapdisk.lock);
+}
+
+// Read the contents of slot into dst. May sleep.
+// Returns the number of bytes read.
+int
+swap_read(int slot, char *dst)
+{
+  struct buf *b;
+  int i, n, len;
+
+  acquire(&swapdisk.lock);
+  len = swapdisk.len[slot];
+  release(&swapdisk.lock);
+  if(len <= 0)
+    panic("swap_read");
+  for(i = 0; i * BSIZE < len; i++){
+    n = len - i * BSIZE;
+    if(n > BSIZE)
+      n = BSIZE;
+    b = bread(ROOTDEV, SWAPSTART + slot * SLOTBLOCKS + i);
+    memmove(dst + i * BSIZE, b->data, n);
+    brelse(b);
+  }
+  return len;
+}
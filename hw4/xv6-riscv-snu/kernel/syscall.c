@@ -105,6 +105,19 @@ extern uint64 sys_close(void);
 extern uint64 sys_memstat(void);
 extern uint64 sys_ktest1(void);
 extern uint64 sys_ktest2(void);
+extern uint64 sys_kbench(void);
+extern uint64 sys_pmemstat(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_shmget(void);
+extern uint64 sys_shmat(void);
+extern uint64 sys_shmdt(void);
+extern uint64 sys_madvise(void);
+extern uint64 sys_setrlimit(void);
+extern uint64 sys_getrlimit(void);
+extern uint64 sys_memcg(void);
+extern uint64 sys_memcgstat(void);
+extern uint64 sys_ksmstat(void);
 #endif
 
 
@@ -136,6 +149,19 @@ static uint64 (*syscalls[])(void) = {
 [SYS_memstat] sys_memstat,
 [SYS_ktest1]  sys_ktest1,
 [SYS_ktest2]  sys_ktest2,
+[SYS_kbench]  sys_kbench,
+[SYS_pmemstat] sys_pmemstat,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_shmget]  sys_shmget,
+[SYS_shmat]   sys_shmat,
+[SYS_shmdt]   sys_shmdt,
+[SYS_madvise] sys_madvise,
+[SYS_setrlimit] sys_setrlimit,
+[SYS_getrlimit] sys_getrlimit,
+[SYS_memcg] sys_memcg,
+[SYS_memcgstat] sys_memcgstat,
+[SYS_ksmstat] sys_ksmstat,
 #endif
 };
 
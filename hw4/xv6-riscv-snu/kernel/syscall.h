@@ -24,4 +24,17 @@
 #define SYS_memstat 22
 #define SYS_ktest1  23
 #define SYS_ktest2  24
+#define SYS_kbench  25
+#define SYS_pmemstat 26
+#define SYS_mmap    27
+#define SYS_munmap  28
+#define SYS_shmget  29
+#define SYS_shmat   30
+#define SYS_shmdt   31
+#define SYS_madvise 32
+#define SYS_setrlimit 33
+#define SYS_getrlimit 34
+#define SYS_memcg   35
+#define SYS_memcgstat 36
+#define SYS_ksmstat 37
 #endif
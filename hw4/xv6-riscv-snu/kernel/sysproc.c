@@ -5,6 +5,7 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "resource.h"
 
 uint64
 sys_exit(void)
@@ -48,6 +49,36 @@ sys_sbrk(void)
   return addr;
 }
 
+// int setrlimit(int resource, uint64 limit)
+// A new RLIMIT_STACK takes effect at the next exec().
+uint64
+sys_setrlimit(void)
+{
+  uint64 lim;
+  int r;
+
+  argint(0, &r);
+  argaddr(1, &lim);
+  if(r < 0 || r >= NRLIMIT)
+    return -1;
+  if(r == RLIMIT_STACK && (lim < USERSTACK * PGSIZE || lim > STACKMAX * PGSIZE))
+    return -1;
+  myproc()->rlim[r] = lim;
+  return 0;
+}
+
+// uint64 getrlimit(int resource)
+uint64
+sys_getrlimit(void)
+{
+  int r;
+
+  argint(0, &r);
+  if(r < 0 || r >= NRLIMIT)
+    return -1;
+  return myproc()->rlim[r];
+}
+
 uint64
 sys_sleep(void)
 {
@@ -17,6 +17,7 @@ void kernelvec();
 
 extern int devintr();
 
+extern void acquire_normal_lock();
 extern void release_normal_lock();
 
 void
@@ -47,6 +48,7 @@ usertrap(void)
   // send interrupts and exceptions to kerneltrap(),
   // since we're now in the kernel.
   w_stvec((uint64)kernelvec);
+  __atomic_store_n(&mycpu()->inuser, 0, __ATOMIC_SEQ_CST);
 
   struct proc *p = myproc();
   
@@ -79,16 +81,33 @@ usertrap(void)
     } else {
       pte_t *pte = walk(p->pagetable, va, 0);
 
-      if(pte == 0){
+      if((pte == 0 || (*pte & (PTE_V | PTE_S)) == 0) &&
+         (va < p->sz || vmafind(p, va, 1))){
+        // first touch of a program, mmap() or sbrk() page
+        if(vmfault(p, va) < 0){
+          printf("usertrap(): out of memory pid=%d va=0x%lx\n", p->pid, va);
+          setkilled(p);
+        } else
+          madvfault(p, va);
+      } else if(pte == 0){
         printf("usertrap(): invalid page access pid=%d va=0x%lx\n", p->pid, va);
         setkilled(p);
       } else if(*pte & PTE_S){
-        if(swapin(p->pagetable, va) == 0){
+        uint64 t0 = r_time();
+        if((*pte & PTE_SD) && zreadback(p->pagetable, va) < 0){
+          printf("usertrap(): readback failed pid=%d va=0x%lx\n", p->pid, va);
+          setkilled(p);
+        }
+        else if(swapin(p->pagetable, va) == 0){
+          release_normal_lock();
           printf("usertrap(): swapin failed pid=%d va=0x%lx\n", p->pid, va);
           setkilled(p);
         }
         else{
+          swapin_readahead(p, va);
+          madvfault(p, va);
           release_normal_lock();
+          swapin_account(p, r_time() - t0);
         }
       } else if(*pte & PTE_V){
         uint64 scause = r_scause();
@@ -106,14 +125,30 @@ usertrap(void)
           goto done;
         }
 
-        if((*pte & access_type) == 0){
+        if(scause == 0xf && (*pte & PTE_COW)){
+          if(uvmcow(p->pagetable, va) < 0){
+            printf("usertrap(): cow failed pid=%d va=0x%lx\n", p->pid, va);
+            setkilled(p);
+          }
+        } else if(scause == 0xf && (*pte & PTE_W) == 0 && vmadirty(p, va) == 0){
+          // first write to a MAP_SHARED page
+        } else if((*pte & access_type) == 0){
           uint64 pa = PTE2PA(*pte);
           if(*pte & PTE_H) pa = pa >> 1;
           printf("usertrap(): access violation cause: %ld pid=%d va=0x%lx pa=0x%lx\n",scause, p->pid, va,pa);
           setkilled(p);
+        } else if((*pte & PTE_A) == 0 || (scause == 0xf && (*pte & PTE_D) == 0)){
+          // the hart leaves PTE_A/PTE_D to software, and kscand
+          // cleared PTE_A.
+          acquire_normal_lock();
+          if(*pte & PTE_V)
+            *pte |= PTE_A | (scause == 0xf ? PTE_D : 0);
+          release_normal_lock();
+          sfence_vma_page(va);
         } else {
-          printf("usertrap(): page fault despite permissions pid=%d va=0x%lx\n", p->pid, va);
-          setkilled(p);
+          // a stale TLB entry: another hart changed the PTE and this
+          // one cached the old or invalid one. see uvmflush().
+          sfence_vma_page(va);
         }
       } else {
         printf("usertrap(): invalid page pid=%d va=0x%lx\n", p->pid, va);
@@ -136,6 +171,9 @@ done:
   if(which_dev == 2)
     yield();
 
+  // push cold compressed pages to the swap disk if ZONE_ZMEM is low.
+  zwriteback();
+
   usertrapret();
 }
 
@@ -175,14 +213,20 @@ usertrapret(void)
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->trapframe->epc);
 
-  // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  // tell trampoline.S the user page table to switch to, and
+  // flush the TLB if p's ASID may have stale entries. Without
+  // ASIDs user and kernel entries share ASID 0, so both switches
+  // of satp flush, as before ASIDs. inuser is set first, so that
+  // uvmflush_wait() either sees it or we see its epoch.
+  __atomic_store_n(&mycpu()->inuser, 1, __ATOMIC_SEQ_CST);
+  uint64 satp = uvmsatp(p);
+  p->trapframe->tlbflush = ASIDOF(satp) == 0;
 
   // jump to userret in trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
   // and switches to user mode with sret.
   uint64 trampoline_userret = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64))trampoline_userret)(satp);
+  ((void (*)(uint64, uint64))trampoline_userret)(satp, p->trapframe->tlbflush);
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -3,6 +3,8 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
 #include "xswap.h"
@@ -17,6 +19,140 @@ extern char trampoline[]; // trampoline.S
 
 extern void acquire_normal_lock();
 extern void release_normal_lock();
+extern struct spinlock *a_lock;
+extern void enqueue(uint64);
+
+// Megapages.
+//
+// uvmalloc() maps each 2MB-aligned 2MB stretch of a growing user
+// image with a single level-1 leaf PTE when kalloc_mega() has a
+// free run, so a big heap takes one TLB entry instead of 512.
+// A megapage is not on the rmap or in the FIFO. Anything that
+// needs to see it as 4KB pages gets there through walk(), which
+// splits it into an ordinary page-table page of 4KB PTEs first;
+// swapout() splits one when it finds nothing else to evict.
+// mega[] records the mapping of each run, under kmem_normal.lock.
+struct {
+  pagetable_t pagetable;
+  uint64 va;
+} mega[NMEGA + 1];
+
+static int
+megaidx(uint64 pa)
+{
+  return (pa - NORMAL_START) / MEGAPGSIZE;
+}
+
+// Return the level-1 leaf PTE mapping va, or 0 if va is not in a
+// megapage. Never allocates or splits.
+pte_t *
+walkmega(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+
+  if(NMEGA == 0 || va >= MAXVA)
+    return 0;
+  pte = &pagetable[PX(2, va)];
+  if((*pte & PTE_V) == 0)
+    return 0;
+  pte = &((pagetable_t)PTE2PA(*pte))[PX(1, va)];
+  if((*pte & PTE_V) == 0 || (*pte & (PTE_R|PTE_W|PTE_X)) == 0)
+    return 0;
+  return pte;
+}
+
+// Replace the megapage leaf *pte mapping va with a page-table page
+// of 4KB PTEs, and hand its frames to the rmap and the FIFO.
+// Returns -1 if out of page-table pages.
+static int
+megasplit(pagetable_t pagetable, uint64 va, pte_t *pte)
+{
+  pagetable_t t;
+  uint64 pa;
+  int i, held;
+
+  if((t = (pagetable_t)kalloc(ZONE_FIXED)) == 0)
+    return -1;
+  held = holding(a_lock);
+  acquire_normal_lock();
+  if((*pte & PTE_V) == 0 || (*pte & (PTE_R|PTE_W|PTE_X)) == 0){
+    // split or unmapped while we allocated t
+    kfree(t, ZONE_FIXED);
+  } else {
+    va &= ~((uint64)MEGAPGSIZE - 1);
+    pa = PTE2PA(*pte);
+    for(i = 0; i < 512; i++){
+      t[i] = PA2PTE(pa + i * PGSIZE) | PTE_FLAGS(*pte);
+      rmap_add(pa + i * PGSIZE, pagetable, va + i * PGSIZE);
+      enqueue(pa + i * PGSIZE);
+    }
+    mega[megaidx(pa)].pagetable = 0;
+    *pte = PA2PTE(t) | PTE_V;
+    uvmflush(va, 512);
+  }
+  if(!held)
+    release_normal_lock();
+  return 0;
+}
+
+// Split some megapage so that swapout() has frames to pick from.
+// kmem_normal.lock must be held. Returns 1 if one was split.
+int
+megasplit_one(void)
+{
+  pte_t *pte;
+  int i;
+
+  for(i = 0; i < NMEGA; i++){
+    if(mega[i].pagetable == 0)
+      continue;
+    pte = walkmega(mega[i].pagetable, mega[i].va);
+    if(pte && megasplit(mega[i].pagetable, mega[i].va, pte) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+// Map the 2MB at va with a megapage, if a run is free and the
+// level-1 slot holds nothing else. Returns 0 on success.
+static int
+megamap(pagetable_t pagetable, uint64 va, int perm)
+{
+  pte_t *pte;
+  pagetable_t t;
+  char *mem;
+  int i;
+
+  if(NMEGA == 0)
+    return -1;
+  pte = &pagetable[PX(2, va)];
+  if((*pte & PTE_V) == 0){
+    if((t = (pagetable_t)kalloc(ZONE_FIXED)) == 0)
+      return -1;
+    memset(t, 0, PGSIZE);
+    *pte = PA2PTE(t) | PTE_V;
+  }
+  pte = &((pagetable_t)PTE2PA(*pte))[PX(1, va)];
+  if(*pte & PTE_V){
+    // a page-table page left over from an earlier split
+    t = (pagetable_t)PTE2PA(*pte);
+    for(i = 0; i < 512; i++)
+      if(t[i])
+        return -1;
+    *pte = 0;
+    kfree(t, ZONE_FIXED);
+  }
+  if((mem = kalloc_mega()) == 0)
+    return -1;
+  acquire_normal_lock();
+  mega[megaidx((uint64)mem)].pagetable = pagetable;
+  mega[megaidx((uint64)mem)].va = va;
+  // A and D preset, so a hart that leaves them to software
+  // does not fault (and split) on the first access.
+  *pte = PA2PTE(mem) | perm | PTE_V | PTE_A | PTE_D;
+  release_normal_lock();
+  return 0;
+}
 
 // Make a direct-map page table for the kernel.
 pagetable_t
@@ -72,9 +208,135 @@ kvminithart()
   sfence_vma();
 }
 
+//
+// Address-space IDs.
+//
+// Each process runs with its own ASID in satp, so the TLB keeps its
+// entries across traps and context switches instead of being flushed
+// on every return to user space. When the ASIDs run out a new
+// generation starts and each hart flushes once before running one
+// of the reissued ASIDs.
+//
+// xv6 has no inter-processor interrupts, so a hart can't shoot down
+// another's entries for a PTE it changed. uvmflush() flushes its own
+// and bumps tlbepoch instead; every other hart flushes its whole TLB
+// before it next returns to user space. One already running user
+// code keeps its entries until it next traps, so a caller that must
+// not race with writes through them waits in uvmflush_wait().
+//
+
+struct {
+  struct spinlock lock;
+  uint gen;            // current generation, from 1
+  int next;            // next ASID to hand out in gen
+  int max;             // largest ASID the harts implement, 0 if none
+} asids;
+
+uint tlbepoch;
+int ntlbflush;         // full flushes by uvmsatp()
+
+// Find out how many ASID bits satp implements: the others read
+// back as zero. Called on hart 0 after kvminithart().
+void
+asidinit(void)
+{
+  initlock(&asids.lock, "asid");
+  w_satp(MAKE_SATP(kernel_pagetable) | SATP_ASID(0xFFFF));
+  asids.max = ASIDOF(r_satp());
+  w_satp(MAKE_SATP(kernel_pagetable));
+  sfence_vma();
+  asids.gen = 1;
+  asids.next = 1;
+}
+
+// Return the satp with which p should return to user space,
+// giving p an ASID and flushing this hart's TLB if necessary.
+// Without ASIDs the satp has ASID 0 and userret flushes instead.
+// Called with interrupts off.
+uint64
+uvmsatp(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  uint epoch = __atomic_load_n(&tlbepoch, __ATOMIC_SEQ_CST);
+
+  if(asids.max == 0){
+    // userret flushes
+    c->tlbepoch = epoch;
+    return MAKE_SATP(p->pagetable);
+  }
+
+  if(p->asidgen != asids.gen){
+    acquire(&asids.lock);
+    if(asids.next > asids.max){
+      asids.gen++;
+      asids.next = 1;
+    }
+    p->asid = asids.next++;
+    p->asidgen = asids.gen;
+    release(&asids.lock);
+  }
+
+  if(c->asidgen != p->asidgen || c->tlbepoch != epoch){
+    sfence_vma();
+    c->asidgen = p->asidgen;
+    c->tlbepoch = epoch;
+    __sync_fetch_and_add(&ntlbflush, 1);
+  }
+  return MAKE_SATP(p->pagetable) | SATP_ASID(p->asid);
+}
+
+// The user PTEs for npages pages at va changed in a way a stale
+// TLB entry must not outlive (-1 pages: any number anywhere).
+// Flush them from this hart's TLB, and make the others flush
+// before they next run user code. A hart that was up to date
+// stays so without a full flush of its own. Returns the new epoch.
+uint
+uvmflush(uint64 va, uint64 npages)
+{
+  struct cpu *c;
+  uint64 a;
+  uint old;
+
+  push_off();
+  c = mycpu();
+  old = __sync_fetch_and_add(&tlbepoch, 1);
+  if(npages > 32){
+    sfence_vma();
+  } else {
+    for(a = va; a < va + npages * PGSIZE; a += PGSIZE)
+      sfence_vma_page(a);
+  }
+  if(c->tlbepoch == old)
+    c->tlbepoch = old + 1;
+  pop_off();
+  return old + 1;
+}
+
+// Wait until no other hart can be running user code on TLB entries
+// from before epoch: each is in the kernel, or flushed at epoch or
+// later on its way out. Without IPIs this may take until the next
+// timer interrupt, so the caller must hold no spinlocks.
+void
+uvmflush_wait(uint epoch)
+{
+  struct cpu *c, *me;
+
+  push_off();
+  me = mycpu();
+  pop_off();
+  for(c = cpus; c < &cpus[NCPU]; c++){
+    if(c == me)
+      continue;
+    while(__atomic_load_n(&c->inuser, __ATOMIC_SEQ_CST) &&
+          (int)(__atomic_load_n(&c->tlbepoch, __ATOMIC_SEQ_CST) - epoch) < 0)
+      ;
+  }
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
-// create any required page-table pages.
+// create any required page-table pages. A megapage on the
+// way is split into 4KB pages.
 //
 // The risc-v Sv39 scheme has three levels of page-table
 // pages. A page-table page contains 512 64-bit PTEs.
@@ -87,11 +349,16 @@ kvminithart()
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
 {
+  pagetable_t root = pagetable;
+
   if(va >= MAXVA)
     panic("walk");
 
   for(int level = 2; level > 0; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
+    if(level == 1 && (*pte & PTE_V) && (*pte & (PTE_R|PTE_W|PTE_X)) &&
+       megasplit(root, va, pte) < 0)
+      return 0;
     if(*pte & PTE_V) {
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
@@ -104,6 +371,8 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
   return &pagetable[PX(0, va)];
 }
 
+static int lazyfault(pagetable_t, uint64);
+
 // Look up a virtual address, return the physical address,
 // or 0 if not mapped.
 // Can only be used to look up user pages.
@@ -116,20 +385,37 @@ walkaddr(pagetable_t pagetable, uint64 va)
   if(va >= MAXVA)
     return 0;
 
+  if(walkmega(pagetable, va)){
+    acquire_normal_lock();
+    if((pte = walkmega(pagetable, va)) != 0){
+      if((*pte & PTE_U) == 0)
+        return 0;
+      return PTE2PA(*pte) + (va & (MEGAPGSIZE - 1));
+    }
+    release_normal_lock();
+  }
   pte = walk(pagetable, va, 0);
+  if((pte == 0 || (*pte & (PTE_V | PTE_S)) == 0) && lazyfault(pagetable, va) == 0)
+    return walkaddr(pagetable, va);
   if(pte == 0)
     return 0;
+  if((*pte & PTE_SD) && zreadback(pagetable, va) < 0)
+    return 0;
   acquire_normal_lock();
   if((*pte & PTE_V) == 0)
   {
     if(*pte & PTE_S && (*pte & PTE_U)){
-      pa = (uint64)swapin(pagetable, va);
+      if((pa = (uint64)swapin(pagetable, va)) != 0)
+        *pte |= PTE_D;
       return pa;
     }
     return 0;
   }
   if((*pte & PTE_U) == 0)
     return 0;
+  // the caller may write to the page (e.g. loadseg()); let a
+  // concurrent swapout() know it changed.
+  *pte |= PTE_D;
   pa = PTE2PA(*pte);
   return pa;
 }
@@ -172,8 +458,8 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
     if(*pte & PTE_V || *pte & PTE_S)
       panic("mappages: remap");
     *pte = PA2PTE(pa) | perm | PTE_V;
-    if((uint64)pa >= NORMAL_START && (uint64)pa < PHYSTOP){
-      update_ipt(pa,pagetable,a);
+    if((uint64)pa >= NORMAL_START && (uint64)pa < PHYSTOP && (perm & PTE_U)){
+      rmap_add(pa,pagetable,a);
     }
     if(a == last)
       break;
@@ -184,48 +470,69 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that were never touched are skipped.
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
   uint64 a;
   pte_t *pte;
+  int flush = 0;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
+    if((a % MEGAPGSIZE) == 0 && a + MEGAPGSIZE <= va + npages*PGSIZE &&
+       walkmega(pagetable, a)){
+      acquire_normal_lock();
+      if((pte = walkmega(pagetable, a)) != 0){
+        mega[megaidx(PTE2PA(*pte))].pagetable = 0;
+        if(do_free)
+          kfree_mega((void*)PTE2PA(*pte));
+        *pte = 0;
+        release_normal_lock();
+        flush = 1;
+        a += MEGAPGSIZE - PGSIZE;
+        continue;
+      }
+      release_normal_lock();
+    }
+    // pages sbrk() reserved but nobody touched have no PTE
     if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+      continue;
     acquire_normal_lock();
-    if((*pte & PTE_V) == 0)
-      {if((*pte & PTE_S) ==0)
-        panic("uvmunmap: not mapped");
-      }
+    if((*pte & (PTE_V | PTE_S)) == 0){
+      release_normal_lock();
+      continue;
+    }
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     uint64 pa = PTE2PA(*pte);
+    int mapped = 1;
     if((uint64)pa >= NORMAL_START && (uint64)pa < PHYSTOP && (*pte & PTE_V)){
-      update_ipt(pa, 0, 0);
+      mapped = rmap_remove(pa, pagetable, a);
     }
+    if(*pte & PTE_V)
+      flush = 1;
     if(do_free){
       if((*pte & PTE_V) == 0){
-        if((*pte & PTE_H)){
-          pa = pa >> 1;
-          zfree((void*)pa, ZHALF);
+        if(*pte & PTE_SD){
+          swap_put(PTE2SLOT(*pte));
         }
         else{
-          zfree((void*)pa, ZFULL);
+          zput(*pte, pagetable, a);
         }
       }
-      else{
+      else if(mapped == 0){
         kfree((void*)pa, ZONE_NORMAL);
       }
     }
     *pte = 0;
     release_normal_lock();
   }
+  if(flush)
+    uvmflush(va, npages);
 }
 
 // create an empty user page table.
@@ -251,8 +558,7 @@ uvmfirst(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("uvmfirst: more than a page");
-  mem = kalloc(ZONE_NORMAL);
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
   release_normal_lock();
@@ -271,13 +577,17 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc(ZONE_NORMAL);
+    if((a % MEGAPGSIZE) == 0 && newsz - a >= MEGAPGSIZE &&
+       megamap(pagetable, a, PTE_R|PTE_U|xperm) == 0){
+      a += MEGAPGSIZE - PGSIZE;
+      continue;
+    }
+    mem = kalloc_zeroed();
     if(mem == 0){
       release_normal_lock();
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
       kfree(mem, ZONE_NORMAL);
       release_normal_lock();
@@ -289,6 +599,138 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
   return newsz;
 }
 
+// Give the page at va, which sbrk() reserved below sz but nothing
+// has touched yet, a zero-filled frame. If mega is set and the
+// whole 2MB around va is untouched heap, it becomes a megapage.
+// Returns 0 if the page is now present, -1 if va is not such a
+// page or out of memory.
+int
+uvmlazy(pagetable_t pagetable, uint64 va, uint64 sz, int mega)
+{
+  pte_t *pte;
+  char *mem;
+  uint64 a;
+
+  if(va >= sz || va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+  if(walkmega(pagetable, va))
+    return 0;
+  if((pte = walk(pagetable, va, 0)) != 0 && (*pte & (PTE_V | PTE_S)))
+    return (*pte & PTE_U) ? 0 : -1;
+
+  a = va & ~((uint64)MEGAPGSIZE - 1);
+  if(mega && a + MEGAPGSIZE <= sz && megamap(pagetable, a, PTE_W|PTE_R|PTE_U) == 0)
+    return 0;
+
+  mem = kalloc_zeroed();
+  if(mem == 0){
+    release_normal_lock();
+    return -1;
+  }
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_U) != 0){
+    kfree(mem, ZONE_NORMAL);
+    release_normal_lock();
+    return -1;
+  }
+  release_normal_lock();
+  return 0;
+}
+
+// Map at va a new frame holding up to n bytes of ip from off,
+// and zeros after them (all zeros if ip is 0). Does nothing if
+// va is already present. Returns 0 on success, -1 on failure.
+int
+uvmfilepage(pagetable_t pagetable, uint64 va, struct inode *ip, uint64 off, uint n, int perm)
+{
+  pte_t *pte;
+  char *mem;
+
+  if((pte = walk(pagetable, va, 0)) != 0 && (*pte & (PTE_V | PTE_S)))
+    return 0;
+  // readi() sleeps, so don't hold kmem_normal.lock across it.
+  // swapout() leaves mem alone until it is mapped.
+  mem = kalloc_zeroed();
+  release_normal_lock();
+  if(mem == 0)
+    return -1;
+  if(ip){
+    ilock(ip);
+    if(readi(ip, 0, (uint64)mem, off, n) < 0){
+      iunlock(ip);
+      acquire_normal_lock();
+      goto bad;
+    }
+    iunlock(ip);
+  }
+  acquire_normal_lock();
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, perm) != 0)
+    goto bad;
+  release_normal_lock();
+  return 0;
+
+ bad:
+  kfree(mem, ZONE_NORMAL);
+  release_normal_lock();
+  return -1;
+}
+
+// Fault in the page at va of the current process p, which has
+// no PTE: a page of an mmap()ed file, a program page exec() left
+// for demand paging, a new page of stack, or an untouched sbrk()
+// page.
+// Returns 0 if the page is now present.
+int
+vmfault(struct proc *p, uint64 va)
+{
+  struct seg *s;
+  struct vma *v;
+  uint64 a;
+
+  if((v = vmafind(p, va, 1)) != 0)
+    return vmafault(p, v, va);
+  if(va >= p->sz)
+    return -1;
+  if((s = segfind(p, va, 1)) != 0)
+    return segfault(p, s, va);
+  if(va >= p->stacklim - PGSIZE && va < p->stacktop){
+    // the stack grows down a page at a time, as far as the guard
+    // page; a program never touches memory below its sp.
+    if(va < p->stacklim || va < PGROUNDDOWN(p->trapframe->sp))
+      return -1;
+    return uvmlazy(p->pagetable, va, p->sz, 0);
+  }
+  a = va & ~((uint64)MEGAPGSIZE - 1);
+  return uvmlazy(p->pagetable, va, p->sz, segfind(p, a, MEGAPGSIZE) == 0);
+}
+
+// A kernel copy to or from a page of the current process that
+// was never touched faults it in, as a user access would.
+static int
+lazyfault(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+
+  if(p == 0 || p->pagetable != pagetable)
+    return -1;
+  return vmfault(p, va);
+}
+
+// Fault in the page at va now if it was never touched, for
+// callers that will copy to or from it under a spinlock, where
+// vmfault() could not sleep in readi().
+void
+vmprefault(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+
+  if(p == 0 || p->pagetable != pagetable || walkmega(pagetable, va))
+    return;
+  if((pte = walk(pagetable, va, 0)) == 0 || (*pte & (PTE_V | PTE_S)) == 0)
+    vmfault(p, va);
+}
+
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
@@ -337,56 +779,141 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Give new a copy of old's megapage at va in a megapage of its
+// own, so that fork() leaves the parent's mapped as it was. A
+// megapage is not on the rmap, so it cannot be shared copy-on-write.
+// Returns -1 if there is no free run, or the parent's megapage was
+// split meanwhile; the caller then copies it as 4KB pages.
+static int
+megacopy(pagetable_t old, pagetable_t new, uint64 va)
+{
+  pte_t *pte, *npte;
+
+  if((pte = walkmega(old, va)) == 0 ||
+     megamap(new, va, PTE_FLAGS(*pte) & (PTE_R|PTE_W|PTE_X|PTE_U)) != 0)
+    return -1;
+  npte = walkmega(new, va);
+  acquire_normal_lock();
+  if((pte = walkmega(old, va)) == 0){
+    mega[megaidx(PTE2PA(*npte))].pagetable = 0;
+    kfree_mega((void*)PTE2PA(*npte));
+    *npte = 0;
+    release_normal_lock();
+    return -1;
+  }
+  memmove((void*)PTE2PA(*npte), (void*)PTE2PA(*pte), MEGAPGSIZE);
+  release_normal_lock();
+  return 0;
+}
+
+// Given a parent process's page table, share its
+// memory from va to va+sz with a child's page table.
+// Resident pages are mapped into both; writable ones
+// become read-only copy-on-write (PTE_COW) in both.
+// Swapped-out pages stay compressed (or on disk) and
+// shared; swapin() maps them back into every sharer,
+// copy-on-write if they were writable. Megapages are
+// copied whole when a free run allows.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
-char buffer[PGSIZE];
-extern int cp_length[];
-int pa2idx_zmem(uint64 pa);
 int
-uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+uvmcopy(pagetable_t old, pagetable_t new, uint64 va, uint64 sz)
 {
-  pte_t *pte;
+  pte_t *pte, *npte;
   uint64 pa, i;
-  uint flags;
-  char *mem;
+  int flush = 0;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    acquire_normal_lock();
-    if((*pte & PTE_V) == 0){
-      if(*pte & PTE_S){
-        swapin(old, i);
-        pte = walk(old,i,0);
-      }
-      else panic("uvmcopy: page not present");
+  for(i = va; i < va + sz; i += PGSIZE){
+    // walk() would split it
+    if((i % MEGAPGSIZE) == 0 && i + MEGAPGSIZE <= va + sz &&
+       megacopy(old, new, i) == 0){
+      i += MEGAPGSIZE - PGSIZE;
+      continue;
     }
-    pa = PTE2PA(*pte);
-    memmove(buffer,(char*)pa,PGSIZE);
-    flags = PTE_FLAGS(*pte);
-    
-    if((mem = kalloc(ZONE_NORMAL)) == 0)
-      {release_normal_lock();goto err;}
-    // memmove(mem, (char*)pa, PGSIZE);
-    memmove(mem, buffer, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem, ZONE_NORMAL);
+    // untouched sbrk() pages stay untouched in the child
+    if((pte = walk(old, i, 0)) == 0 || (*pte & (PTE_V | PTE_S)) == 0)
+      continue;
+    acquire_normal_lock();
+    if((npte = walk(new, i, 1)) == 0){
       release_normal_lock();
       goto err;
     }
+    if(*pte & PTE_SD){
+      // share the disk slot; whichever process touches
+      // the page first reads it back.
+      swap_dup(PTE2SLOT(*pte));
+    }
+    else if((*pte & PTE_V) == 0){
+      zdup(pte, old, new, i);
+    }
+    else{
+      pa = PTE2PA(*pte);
+      if(*pte & PTE_W){
+        *pte = (*pte & ~PTE_W) | PTE_COW;
+        flush = 1;
+      }
+      rmap_add(pa, new, i);
+    }
+    *npte = *pte;
     release_normal_lock();
   }
+  if(flush)
+    uvmflush(0, -1);
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  if(flush)
+    uvmflush(0, -1);
+  uvmunmap(new, va, (i - va) / PGSIZE, 1);
   return -1;
 }
 
+// Give the page at va a private, writable frame after a
+// write to a copy-on-write mapping.
+// kmem_normal.lock must be held.
+static int
+cowcopy(pagetable_t pagetable, uint64 va, pte_t *pte)
+{
+  uint64 pa = PTE2PA(*pte);
+  char *mem;
+
+  va = PGROUNDDOWN(va);
+  if(rmap_count(pa) == 1){
+    // the other sharers are gone; take the frame over.
+    *pte = (*pte | PTE_W) & ~PTE_COW;
+  } else {
+    // kalloc() may swap out; keep it from picking pa.
+    rmap_pin(pa, 1);
+    mem = kalloc(ZONE_NORMAL);
+    rmap_pin(pa, 0);
+    if(mem == 0)
+      return -1;
+    memmove(mem, (char*)pa, PGSIZE);
+    rmap_remove(pa, pagetable, va);
+    *pte = PA2PTE(mem) | ((PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW);
+    rmap_add((uint64)mem, pagetable, va);
+  }
+  uvmflush(va, 1);
+  return 0;
+}
+
+// Handle a store page fault on a copy-on-write page.
+// Returns 0 on success, -1 if va is not COW or out of memory.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  int r = -1;
+
+  if(va >= MAXVA || (pte = walk(pagetable, va, 0)) == 0)
+    return -1;
+  acquire_normal_lock();
+  if((*pte & PTE_V) && (*pte & PTE_U) && (*pte & PTE_COW))
+    r = cowcopy(pagetable, va, pte);
+  release_normal_lock();
+  return r;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -413,16 +940,40 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
     va0 = PGROUNDDOWN(dstva);
     if(va0 >= MAXVA)
       return -1;
+    acquire_normal_lock();
+    if((pte = walkmega(pagetable, va0)) != 0){
+      if((*pte & PTE_U) == 0 || (*pte & PTE_W) == 0){
+        release_normal_lock();
+        return -1;
+      }
+      pa0 = PTE2PA(*pte) + (va0 & (MEGAPGSIZE - 1));
+      goto copy;
+    }
+    release_normal_lock();
     pte = walk(pagetable, va0, 0);
+    if((pte == 0 || (*pte & (PTE_V | PTE_S)) == 0) && lazyfault(pagetable, va0) == 0)
+      continue;
+    if(pte != 0 && (*pte & PTE_SD) && zreadback(pagetable, va0) < 0)
+      return -1;
     acquire_normal_lock();
     if(pte != 0 && (*pte & PTE_V) == 0 && (*pte & PTE_S)){
       swapin(pagetable, va0);
       pte = walk(pagetable, va0, 0);
     }
+    if(pte != 0 && (*pte & PTE_V) && (*pte & PTE_U) && (*pte & PTE_COW) &&
+       cowcopy(pagetable, va0, pte) < 0){
+      release_normal_lock();
+      return -1;
+    }
+    if(pte != 0 && (*pte & PTE_V) && (*pte & PTE_U) && (*pte & PTE_W) == 0 &&
+       myproc() && myproc()->pagetable == pagetable)
+      vmadirty(myproc(), va0);
     if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 ||
        (*pte & PTE_W) == 0)
       return -1;
+    *pte |= PTE_D;
     pa0 = PTE2PA(*pte);
+ copy:
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
@@ -22,10 +22,22 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "xswap.h"
+#include "pmstat.h"
 // #include "lzo.c"
 
 int nalloc4k, zalloc4k, zalloc2k;
 int nswapin, nswapout;
+int nwriteback, nreadback;
+int nkswapd;
+int nreadahead, nrahit;
+int nzraw, nzabort;
+int nkscand;
+int nzcompact;
+#ifdef KSM
+int nksmscan, nksmmerge;
+uint64 ksmticks;
+static int ksm_sharing(void);
+#endif
 
 
 uint64
@@ -58,24 +70,173 @@ sys_memstat()
     }
   }
 
-  return nalloc4k + zalloc2k + zalloc4k;
+  return nalloc4k + zalloc2k + zalloc4k + nswapslot;
+}
+
+// Bin one swap-in fault's latency (in r_time() ticks) for pmemstat().
+void
+swapin_account(struct proc *p, uint64 dt)
+{
+  int b = 0;
+
+  dt >>= PMSTAT_LAT0;
+  while(dt && b < NSWAPLAT-1){
+    dt >>= 1;
+    b++;
+  }
+  p->nswapin++;
+  p->swapin_lat[b]++;
+}
+
+extern struct proc proc[NPROC];
+int pa2idx_zmem(uint64 pa);
+static uint64 zpte2pa(pte_t pte, int *type);
+extern int cp_length[];
+
+// Count the pages of [va, end) in pagetable into st. Reads the
+// tables directly instead of through walk(), which would split a
+// megapage, and steps over a whole 1GB or 2MB span at once when its
+// level-2 or level-1 entry is absent, so a large lazy sbrk() costs
+// next to nothing.
+static void
+pmstat_range(pagetable_t pagetable, uint64 va, uint64 end, struct pmstat *st)
+{
+  pagetable_t l1, l0;
+  pte_t pte;
+  int type;
+
+  if(end > MAXVA)
+    end = MAXVA;
+  for(va = PGROUNDDOWN(va); va < end; va += PGSIZE){
+    pte = pagetable[PX(2, va)];
+    if((pte & PTE_V) == 0){
+      va = (va | (MEGAPGSIZE * 512 - 1)) - PGSIZE + 1;
+      continue;
+    }
+    l1 = (pagetable_t)PTE2PA(pte);
+    pte = l1[PX(1, va)];
+    if((pte & PTE_V) == 0){
+      va = (va | (MEGAPGSIZE - 1)) - PGSIZE + 1;
+      continue;
+    }
+    if(pte & (PTE_R|PTE_W|PTE_X)){
+      st->resident++;
+      continue;
+    }
+    l0 = (pagetable_t)PTE2PA(pte);
+    pte = l0[PX(0, va)];
+    if(pte & PTE_V){
+      st->resident++;
+    } else if(pte & PTE_S){
+      if(pte & PTE_SD){
+        st->disk++;
+        continue;
+      }
+      if(pte & PTE_H)
+        st->half++;
+      else
+        st->full++;
+      st->zbytes += cp_length[pa2idx_zmem(zpte2pa(pte, &type))];
+    }
+  }
 }
 
+// Fill st from p's page table: the heap and stack below p->sz and
+// every mmap() and shm mapping. Caller holds p->lock, which keeps
+// exec() and freeproc() from swapping the table out from under us;
+// the PTEs themselves are read racily, like the global counters.
+static void
+pmstat_fill(struct proc *p, struct pmstat *st)
+{
+  struct vma *v;
+
+  memset(st, 0, sizeof(*st));
+  st->pid = p->pid;
+  safestrcpy(st->name, p->name, sizeof(st->name));
+  st->nswapin = p->nswapin;
+  st->memcg = p->memcg;
+  memmove(st->lat, p->swapin_lat, sizeof(st->lat));
+  if(p->pagetable == 0)
+    return;
+  pmstat_range(p->pagetable, 0, p->sz, st);
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->f != 0 || v->shm != 0)
+      pmstat_range(p->pagetable, v->va, v->va + v->len, st);
+}
+
+// int pmemstat(struct pmstat *buf, int n)
+// Copy out one struct pmstat per live process, at most n.
+// Returns the number copied, or -1.
+uint64
+sys_pmemstat(void)
+{
+  uint64 buf;
+  int n, cnt = 0;
+  struct proc *p;
+  struct pmstat st;
+
+  argaddr(0, &buf);
+  argint(1, &n);
+  for(p = proc; p < &proc[NPROC] && cnt < n; p++){
+    acquire(&p->lock);
+    if(p->state == UNUSED || p->state == USED){
+      release(&p->lock);
+      continue;
+    }
+    pmstat_fill(p, &st);
+    release(&p->lock);
+    if(copyout(myproc()->pagetable, buf + cnt*sizeof(st), (char *)&st, sizeof(st)) < 0)
+      return -1;
+    cnt++;
+  }
+  return cnt;
+}
+
+// int ksmstat(struct ksmstat *st)
+// Returns -1 if the kernel was built without KSM.
+uint64
+sys_ksmstat(void)
+{
+#ifdef KSM
+  struct ksmstat st;
+  uint64 addr;
+
+  argaddr(0, &addr);
+  st.nscan = nksmscan;
+  st.nmerge = nksmmerge;
+  st.sharing = ksm_sharing();
+  st.scanms = ksmticks / 10000;
+  return copyout(myproc()->pagetable, addr, (char *)&st, sizeof(st));
+#else
+  return -1;
+#endif
+}
 
 // Called when ^x is pressed
 void
 mallocstat(void)
 {
   printf("total: %d, nalloc4k: %d, zalloc4k: %d, zalloc2k: %d, swapin: %d, swapout: %d\n",
-    nalloc4k+zalloc4k+zalloc2k, nalloc4k, zalloc4k, zalloc2k, nswapin, nswapout);
-}
-#ifdef PART3
-struct spinlock lzo_lock;
+    nalloc4k+zalloc4k+zalloc2k+nswapslot, nalloc4k, zalloc4k, zalloc2k, nswapin, nswapout);
+  printf("swapslots: %d, writeback: %d, readback: %d, kswapd: %d\n",
+    nswapslot, nwriteback, nreadback, nkswapd);
+  printf("readahead: %d, rahit: %d\n", nreadahead, nrahit);
+  printf("zraw: %d, zabort: %d, kscand: %d, tlbflush: %d, zcompact: %d\n",
+    nzraw, nzabort, nkscand, ntlbflush, nzcompact);
+  memcgprint();
+#ifdef KSM
+  printf("ksm: scanned: %d, merged: %d, sharing: %d, scan time: %d ms\n",
+    nksmscan, nksmmerge, ksm_sharing(), (int)(ksmticks / 10000));
 #endif
+}
 
 //외부 함수
+void acquire_normal_lock();
+void release_normal_lock();
 void enqueue(uint64);
 struct run* dequeue(void);
+uint64 dequeue_memcg(int);
+extern struct spinlock *a_lock;
 
 int lzo1x_compress(const unsigned char *src, uint32 src_len, unsigned char *dst, uint32 *dst_len, void *wrkmem);
 int lzo1x_decompress(const unsigned char *src, uint32 src_len, unsigned char *dst, uint32 *dst_len);
@@ -90,46 +251,209 @@ int pa2idx_zmem(uint64 pa) {
   return (pa - PHYSTOP) / HPGSIZE;
 }
 
+uint64 idx2pa_zmem(int idx) {
+  return PHYSTOP + (uint64)idx * HPGSIZE;
+}
+
 #define NUM_HPAGES ((ZMEMSTOP - PHYSTOP) / HPGSIZE)
 int cp_length[NUM_HPAGES];
 char zmem_page_allocated[NUM_HPAGES];
 
+// Back-pointer from each stored object in ZONE_ZMEM to the swap PTE
+// that names it, kept in swap-out order (oldest at head). Indexed by
+// the 2KB index of the object's first half, like cp_length[].
+// seq changes every time the slot is reused, so writeback can tell
+// whether an object it copied out is still the same one.
+struct zmem_info {
+  pagetable_t pagetable;
+  uint64 va;
+  uint seq;
+  int next;
+  int prev;
+  int in_lru;
+};
+
+struct {
+  int head;
+  int tail;
+  uint seq;
+  struct zmem_info objs[NUM_HPAGES];
+} zmem_lru;
+
 struct run {
   struct run *next;
 };
 
-struct inverted_pte {
+// Reverse map.
+//
+// Every PTE that maps a ZONE_NORMAL frame has a struct rmap on
+// that frame's chain in ipt[]. While the page is swapped out the
+// chain moves to the ZONE_ZMEM object, in zrmap[]. swapout() uses
+// it to unmap a shared frame from all of its mappers at once, and
+// swapin() to map the decompressed frame back into all of them.
+//
+// Each chain is protected by one of NRMAPLOCK striped locks, hashed
+// by frame (ipt_locks) or object (zrmap_locks) index; a frame's lock
+// is always taken before an object's. Free entries are under
+// rmap_lock. The PTEs on a chain may only be changed with
+// kmem_normal.lock held, as before.
+//
+// PTE_COW is the same bit as PTE_H, so while a copy-on-write page
+// is swapped out its entry's cow flag stands in for it.
+struct rmap {
   pagetable_t pagetable;
   uint64 va;
+  int cow;      // PTE_COW, while on a zrmap[] chain
+  struct rmap *next;
+};
+
+struct rmap_head {
+  struct rmap *first;
+  int n;        // number of PTEs on the chain
+  int pin;      // swapout() must leave the frame alone
+  uint gen;     // bumped whenever the chain changes
+  uchar idle;   // kscand scans since a PTE was last accessed
+  uchar ksm;    // merged by ksm_merge()
+  uint sum;     // checksum as of the last ksm_scan()
 };
 
 int zfreestart = 0;
 
-struct spinlock ipt_lock;
+#define NRMAPLOCK 16
+struct spinlock ipt_locks[NRMAPLOCK];
+struct spinlock zrmap_locks[NRMAPLOCK];
+struct spinlock rmap_lock;
+#define IPT_LOCK(idx)   (&ipt_locks[(idx) % NRMAPLOCK])
+#define ZRMAP_LOCK(idx) (&zrmap_locks[(idx) % NRMAPLOCK])
 
 #define NUM_PHYSPAGES ((PHYSTOP - NORMAL_START) / PGSIZE)
-struct inverted_pte ipt[NUM_PHYSPAGES];
+struct rmap_head ipt[NUM_PHYSPAGES];
+struct rmap_head zrmap[NUM_HPAGES];
+struct rmap *rmap_freelist;
 
-void update_ipt(uint64 pa, pagetable_t pagetable, uint64 va)
+// Entries are carved out of ZONE_FIXED pages as needed.
+static struct rmap* rmap_alloc(void)
+{
+  struct rmap *r;
+  int i;
+
+  acquire(&rmap_lock);
+  if(rmap_freelist == 0){
+    if((r = kalloc(ZONE_FIXED)) == 0)
+      panic("rmap_alloc");
+    for(i = 0; i < PGSIZE / sizeof(struct rmap); i++){
+      r[i].next = rmap_freelist;
+      rmap_freelist = &r[i];
+    }
+  }
+  r = rmap_freelist;
+  rmap_freelist = r->next;
+  release(&rmap_lock);
+  return r;
+}
+
+static void rmap_free(struct rmap *r)
+{
+  acquire(&rmap_lock);
+  r->next = rmap_freelist;
+  rmap_freelist = r;
+  release(&rmap_lock);
+}
+
+// The chain's lock must be held.
+static void rmap_link(struct rmap_head *h, pagetable_t pagetable, uint64 va)
+{
+  struct rmap *r = rmap_alloc();
+
+  r->pagetable = pagetable;
+  r->va = PGROUNDDOWN(va);
+  r->cow = 0;
+  r->next = h->first;
+  h->first = r;
+  h->n++;
+  h->gen++;
+}
+
+// The chain's lock must be held. Returns the number of PTEs left.
+static int rmap_unlink(struct rmap_head *h, pagetable_t pagetable, uint64 va)
+{
+  struct rmap **pp, *r;
+
+  va = PGROUNDDOWN(va);
+  for(pp = &h->first; (r = *pp) != 0; pp = &r->next){
+    if(r->pagetable == pagetable && r->va == va){
+      *pp = r->next;
+      rmap_free(r);
+      h->gen++;
+      if(--h->n == 0)
+        h->idle = h->ksm = 0;
+      return h->n;
+    }
+  }
+  panic("rmap_unlink");
+  return -1;
+}
+
+static int ipt_idx(uint64 pa)
 {
   int idx = pa2idx_normal(pa);
   if(idx < 0 || idx >= NUM_PHYSPAGES){
-    panic("update_ipt: invalid index");
+    panic("ipt: invalid index");
   }
+  return idx;
+}
+
+// Record that va in pagetable maps the ZONE_NORMAL frame pa.
+void rmap_add(uint64 pa, pagetable_t pagetable, uint64 va)
+{
+  int idx = ipt_idx(pa);
 
-  acquire(&ipt_lock);
-  ipt[idx].pagetable = pagetable;
-  ipt[idx].va = va;
-  release(&ipt_lock);
+  acquire(IPT_LOCK(idx));
+  rmap_link(&ipt[idx], pagetable, va);
+  release(IPT_LOCK(idx));
+}
+
+// Forget the mapping of pa at va in pagetable.
+// Returns the number of PTEs still mapping pa.
+int rmap_remove(uint64 pa, pagetable_t pagetable, uint64 va)
+{
+  int idx = ipt_idx(pa), n;
+
+  acquire(IPT_LOCK(idx));
+  n = rmap_unlink(&ipt[idx], pagetable, va);
+  release(IPT_LOCK(idx));
+  return n;
+}
+
+int rmap_count(uint64 pa)
+{
+  return ipt[ipt_idx(pa)].n;
+}
+
+// Keep swapout() away from pa while the caller copies it.
+void rmap_pin(uint64 pa, int pin)
+{
+  int idx = ipt_idx(pa);
+
+  acquire(IPT_LOCK(idx));
+  ipt[idx].pin += pin ? 1 : -1;
+  release(IPT_LOCK(idx));
 }
 
 void initAlloc(void){
-  initlock(&ipt_lock, "ipt_lock");
-  #ifdef PART3
-  initlock(&lzo_lock, "lzo_lock");
-  #endif
+  for(int i = 0; i < NRMAPLOCK; i++){
+    initlock(&ipt_locks[i], "ipt");
+    initlock(&zrmap_locks[i], "zrmap");
+  }
+  initlock(&rmap_lock, "rmap");
   nalloc4k = zalloc4k = zalloc2k = nswapin = nswapout = 0;
+  nwriteback = nreadback = nkswapd = 0;
+  nreadahead = nrahit = 0;
+  nzraw = nzabort = 0;
   memset(zmem_page_allocated,0,sizeof(zmem_page_allocated));
+  memset(&zmem_lru,0,sizeof(zmem_lru));
+  zmem_lru.head = zmem_lru.tail = -1;
+  swapdisk_init();
 }
 
 struct run* get_buddy(struct run* r, int size) {
@@ -138,16 +462,99 @@ struct run* get_buddy(struct run* r, int size) {
   return (struct run*)buddy;
 }
 
+// 2KB blocks are kept on a doubly linked list so that zfree() can
+// unlink a free buddy in O(1) instead of scanning freelist_2kb.
+struct zrun {
+  struct zrun *next;
+  struct zrun *prev;
+};
+
 struct {
   struct spinlock lock;
-  struct run* freelist_2kb;
+  struct zrun* freelist_2kb;
   struct run* freelist_4kb;
+  int nfree_2kb;        // length of freelist_2kb
 } zmem;
 
+static void zpush_2kb(struct zrun *r) {
+  r->prev = 0;
+  r->next = zmem.freelist_2kb;
+  if(zmem.freelist_2kb)
+    zmem.freelist_2kb->prev = r;
+  zmem.freelist_2kb = r;
+  zmem.nfree_2kb++;
+}
+
+static void zremove_2kb(struct zrun *r) {
+  if(r->prev)
+    r->prev->next = r->next;
+  else
+    zmem.freelist_2kb = r->next;
+  if(r->next)
+    r->next->prev = r->prev;
+  r->next = r->prev = 0;
+  zmem.nfree_2kb--;
+}
+
+// zmem.lock must be held.
+static void zlru_remove(int idx) {
+  struct zmem_info *z = &zmem_lru.objs[idx];
+
+  if(!z->in_lru)
+    return;
+  if(z->prev != -1)
+    zmem_lru.objs[z->prev].next = z->next;
+  else
+    zmem_lru.head = z->next;
+  if(z->next != -1)
+    zmem_lru.objs[z->next].prev = z->prev;
+  else
+    zmem_lru.tail = z->prev;
+  z->next = z->prev = -1;
+  z->in_lru = 0;
+  z->pagetable = 0;
+  z->seq = 0;
+}
+
+// Append the ZONE_ZMEM object idx to the LRU as the most recently
+// swapped out. pagetable is its only mapper, or 0 if it is shared.
+static void zlru_add(int idx, pagetable_t pagetable, uint64 va) {
+  struct zmem_info *z = &zmem_lru.objs[idx];
+
+  acquire(&zmem.lock);
+  zlru_remove(idx);
+  z->pagetable = pagetable;
+  z->va = PGROUNDDOWN(va);
+  z->seq = ++zmem_lru.seq;
+  if(z->seq == 0)
+    z->seq = ++zmem_lru.seq;
+  z->in_lru = 1;
+  z->next = -1;
+  z->prev = zmem_lru.tail;
+  if(zmem_lru.tail != -1)
+    zmem_lru.objs[zmem_lru.tail].next = idx;
+  zmem_lru.tail = idx;
+  if(zmem_lru.head == -1)
+    zmem_lru.head = idx;
+  release(&zmem.lock);
+}
+
+// Record that the ZONE_ZMEM object at zpa holds the page
+// mapped at va in pagetable, as the most recently swapped out.
+void ztrack(void *zpa, pagetable_t pagetable, uint64 va) {
+  int idx = pa2idx_zmem((uint64)zpa);
+
+  acquire(ZRMAP_LOCK(idx));
+  rmap_link(&zrmap[idx], pagetable, va);
+  release(ZRMAP_LOCK(idx));
+  zlru_add(idx, pagetable, va);
+}
+
 void init_zmem(void) {
   initlock(&zmem.lock, "zmem");
   zmem.freelist_2kb = 0;
   zmem.freelist_4kb = 0;
+  zmem.nfree_2kb = 0;
 }
 
 void zfreerange(void *pa_start, void *pa_end){
@@ -158,23 +565,107 @@ void zfreerange(void *pa_start, void *pa_end){
   zfreestart = 1;
 }
 
+// ZONE_ZMEM address and type of the object named by a swap PTE.
+static uint64 zpte2pa(pte_t pte, int *type) {
+  uint64 pa = PTE2PA(pte);
+
+  if(pte & PTE_H){
+    *type = ZHALF;
+    return pa >> 1;
+  }
+  *type = ZFULL;
+  return pa;
+}
+
+// Set the writeback owner of object idx from its chain:
+// the single mapper, or none while it is shared.
+static void zowner(int idx, pagetable_t pagetable, uint64 va, int n) {
+  acquire(&zmem.lock);
+  zmem_lru.objs[idx].pagetable = (n == 1) ? pagetable : 0;
+  zmem_lru.objs[idx].va = va;
+  release(&zmem.lock);
+}
+
+// fork() is about to copy the swap PTE pte at va in old to va
+// in new. A writable page becomes copy-on-write in both, like a
+// resident one; the caller copies *pte after this.
+// kmem_normal.lock must be held.
+void zdup(pte_t *pte, pagetable_t old, pagetable_t new, uint64 va) {
+  int type;
+  int idx = pa2idx_zmem(zpte2pa(*pte, &type));
+  struct rmap *r;
+
+  acquire(ZRMAP_LOCK(idx));
+  for(r = zrmap[idx].first; r; r = r->next)
+    if(r->pagetable == old && r->va == va)
+      break;
+  if(r == 0)
+    panic("zdup: rmap");
+  if(*pte & PTE_W){
+    *pte &= ~PTE_W;
+    r->cow = 1;
+  }
+  rmap_link(&zrmap[idx], new, va);
+  zrmap[idx].first->cow = r->cow;
+  release(ZRMAP_LOCK(idx));
+  zowner(idx, 0, 0, 2);
+}
+
+// Drop the swap PTE pte at va in pagetable; the object is freed
+// with its last mapper.
+void zput(pte_t pte, pagetable_t pagetable, uint64 va) {
+  int type, n;
+  uint64 pa = zpte2pa(pte, &type);
+  int idx = pa2idx_zmem(pa);
+
+  acquire(ZRMAP_LOCK(idx));
+  n = rmap_unlink(&zrmap[idx], pagetable, va);
+  if(n == 1){
+    pagetable = zrmap[idx].first->pagetable;
+    va = zrmap[idx].first->va;
+  }
+  release(ZRMAP_LOCK(idx));
+  if(n == 0)
+    zfree((void*)pa, type);
+  else if(n == 1)
+    zowner(idx, pagetable, va, n);
+}
+
+// Drop the chain of a ZONE_ZMEM object that writeback moved to disk.
+static void zrmap_drop(int idx) {
+  struct rmap *r;
+
+  acquire(ZRMAP_LOCK(idx));
+  while((r = zrmap[idx].first) != 0){
+    zrmap[idx].first = r->next;
+    rmap_free(r);
+  }
+  zrmap[idx].n = 0;
+  zrmap[idx].gen++;
+  release(ZRMAP_LOCK(idx));
+}
+
+static int zcompact(int n);
+
+// Allocate a ZONE_ZMEM object. A ZFULL allocation that finds no
+// free page compacts the half-used ones first, so the caller must
+// not hold zmem.lock or a chain lock.
 void* zalloc(int type) {
   struct run *r;
 
+  if(type == ZFULL && zmem.freelist_4kb == 0 && zmem.nfree_2kb >= 2)
+    zcompact(ZCOMPACT_BATCH);
   acquire(&zmem.lock);
   if(type == ZHALF){
     if(zmem.freelist_2kb){
-      r = zmem.freelist_2kb;
-      zmem.freelist_2kb = r->next;
+      r = (struct run*)zmem.freelist_2kb;
+      zremove_2kb(zmem.freelist_2kb);
       zalloc2k++;
     } else if(zmem.freelist_4kb){
       r = zmem.freelist_4kb;
       zmem.freelist_4kb = r->next;
       zalloc2k++;
-      struct run *buddy = (struct run*)((char*)r + HPGSIZE);
-
-      buddy->next = zmem.freelist_2kb;
-      zmem.freelist_2kb = buddy;
+      zpush_2kb((struct zrun*)((char*)r + HPGSIZE));
     } else {
       r = 0;
     }
@@ -215,36 +706,27 @@ void zfree(void* pa, int type){
     panic("zfree f");
   }
   zmem_page_allocated[idx] = 0;
+  zlru_remove(idx);
 
   r = (struct run*) pa;
 
   if(type == ZHALF){
+    // A ZHALF block's 4KB page is never on freelist_4kb, so a buddy
+    // that is not allocated must be sitting on freelist_2kb.
     struct run* buddy = get_buddy(r, HPGSIZE);
-    struct run** prev = &zmem.freelist_2kb;
-    struct run* cur = zmem.freelist_2kb;
-    int merged = 0;
     int buddy_idx = pa2idx_zmem((uint64)buddy);
     if(zmem_page_allocated[buddy_idx] == 0){
-      while(cur){
-        if(cur == buddy){
-          *prev = cur->next;
-
-          struct run* block = (struct run*)((uint64)r & ~((uint64)(PGSIZE - 1)));
-          block->next = zmem.freelist_4kb;
-          zmem.freelist_4kb = block;
-          merged = 1;
-          break;
-        }
-        prev = &cur->next;
-        cur = cur->next;
-      }
+      zremove_2kb((struct zrun*)buddy);
+
+      struct run* block = (struct run*)((uint64)r & ~((uint64)(PGSIZE - 1)));
+      block->next = zmem.freelist_4kb;
+      zmem.freelist_4kb = block;
     }
-    if(!merged){
-      r->next = zmem.freelist_2kb;
-      zmem.freelist_2kb = r;
+    else{
+      zpush_2kb((struct zrun*)r);
     }
     zalloc2k--;
-    
+
   }
   else{
     zalloc4k--;
@@ -254,176 +736,1116 @@ void zfree(void* pa, int type){
   release(&zmem.lock);
 }
 
+// Compaction.
+//
+// A page holding one live ZHALF object and one free half is of no
+// use to a ZFULL allocation. zcompact() moves such objects into the
+// free halves of other pages, rewriting the swap PTEs on their
+// zrmap[] chains, so that the pages they leave become whole again.
+// Objects not yet on a chain, which zstore() or zreadback() are
+// still filling, stay where they are.
+
+// Move the LRU entry of object s to object d, keeping its place.
+// zmem.lock must be held.
+static void zlru_move(int s, int d) {
+  struct zmem_info *zs = &zmem_lru.objs[s], *zd = &zmem_lru.objs[d];
+
+  if(!zs->in_lru)
+    return;
+  *zd = *zs;
+  // a writeback that copied s out must not switch to d.
+  zd->seq = ++zmem_lru.seq;
+  if(zd->seq == 0)
+    zd->seq = ++zmem_lru.seq;
+  if(zd->prev != -1)
+    zmem_lru.objs[zd->prev].next = d;
+  else
+    zmem_lru.head = d;
+  if(zd->next != -1)
+    zmem_lru.objs[zd->next].prev = d;
+  else
+    zmem_lru.tail = d;
+  zs->next = zs->prev = -1;
+  zs->in_lru = 0;
+  zs->pagetable = 0;
+  zs->seq = 0;
+}
+
+// Move the ZHALF object s into the free half d, which the caller
+// has allocated, and point every swap PTE that names s at d.
+// kmem_normal.lock must be held.
+static void zmove(int s, int d) {
+  uint64 spa = idx2pa_zmem(s), dpa = idx2pa_zmem(d);
+  struct spinlock *ls = ZRMAP_LOCK(s), *ld = ZRMAP_LOCK(d);
+  struct rmap *r;
+  pte_t *pte;
+
+  acquire(ls < ld ? ls : ld);
+  if(ls != ld)
+    acquire(ls < ld ? ld : ls);
+  memmove((void*)dpa, (void*)spa, cp_length[s]);
+  cp_length[d] = cp_length[s];
+  for(r = zrmap[s].first; r; r = r->next){
+    pte = walk(r->pagetable, r->va, 0);
+    if(pte == 0 || (*pte & (PTE_V | PTE_S | PTE_H)) != (PTE_S | PTE_H) ||
+       (PTE2PA(*pte) >> 1) != spa)
+      panic("zmove: pte");
+    *pte = PTE_FLAGS(*pte) | PA2PTE(dpa << 1);
+  }
+  zrmap[d].first = zrmap[s].first;
+  zrmap[d].n = zrmap[s].n;
+  zrmap[d].gen++;
+  zrmap[s].first = 0;
+  zrmap[s].n = 0;
+  zrmap[s].gen++;
+  release(ls);
+  if(ls != ld)
+    release(ld);
+
+  acquire(&zmem.lock);
+  zlru_move(s, d);
+  release(&zmem.lock);
+}
+
+// Make up to n half-used pages whole. Returns how many were.
+static int zcompact(int n) {
+  struct zrun *d, *f;
+  int s, done = 0;
+  int held = holding(a_lock);
+
+  // swap PTEs and chains only change under kmem_normal.lock.
+  acquire_normal_lock();
+  while(done < n){
+    acquire(&zmem.lock);
+    // the first free half takes the object beside any other one.
+    d = zmem.freelist_2kb;
+    for(f = d ? d->next : 0; f; f = f->next){
+      s = pa2idx_zmem((uint64)get_buddy((struct run*)f, HPGSIZE));
+      if(zmem_page_allocated[s] == ZHALF && zrmap[s].n > 0)
+        break;
+    }
+    if(f == 0){
+      release(&zmem.lock);
+      break;
+    }
+    zremove_2kb(d);
+    zmem_page_allocated[pa2idx_zmem((uint64)d)] = ZHALF;
+    zalloc2k++;
+    release(&zmem.lock);
+
+    zmove(s, pa2idx_zmem((uint64)d));
+    zfree((void*)idx2pa_zmem(s), ZHALF);
+    nzcompact++;
+    done++;
+  }
+  if(!held)
+    release_normal_lock();
+  return done;
+}
+
 void sfence_vma_page(uint64 va){
   asm volatile("sfence.vma %0" : : "r" (va) : "memory");
 }
 
-void* swapout(void)
+// Check that every PTE on frame pa's chain maps pa, and clear
+// or test their dirty bits. Returns -1 if a PTE does not map pa,
+// 1 if clean is 0 and a PTE is dirty, else 0.
+// The caller flushes the TLB after cleaning.
+// The chain's lock must be held.
+static int rmap_check(struct rmap_head *h, uint64 pa, int clean)
 {
-  void* swap_pa;
-  struct run* r = dequeue();
-  if(!r) return 0;
+  struct rmap *r;
+  pte_t *pte;
+  int dirty = 0;
+
+  for(r = h->first; r; r = r->next){
+    pte = walk(r->pagetable, r->va, 0);
+    if(pte == 0 || (*pte & PTE_V) == 0 || PTE2PA(*pte) != pa)
+      return -1;
+    if(clean)
+      *pte &= ~PTE_D;
+    if(*pte & PTE_D)
+      dirty = 1;
+  }
+  return dirty;
+}
 
-  uint64 pa = (uint64)r;
+// Point every PTE on frame idx's chain at the ZONE_ZMEM object
+// zpa and move the chain over to it. The caller flushes the TLB.
+// The frame's lock must be held.
+static void rmap_swapout(int idx, void *zpa, int half)
+{
+  struct rmap_head *h = &ipt[idx];
+  int zidx = pa2idx_zmem((uint64)zpa);
+  uint64 spa = half ? (uint64)zpa << 1 : (uint64)zpa;
+  struct rmap *r;
+  pte_t *pte;
+
+  for(r = h->first; r; r = r->next){
+    pte = walk(r->pagetable, r->va, 0);
+    // the last sharer of a COW frame owns it outright
+    if(h->n == 1 && (*pte & PTE_COW))
+      *pte = (*pte | PTE_W) & ~PTE_COW;
+    r->cow = (*pte & PTE_COW) != 0;
+    *pte = (PTE_FLAGS(*pte) & ~(PTE_V | PTE_H)) | PTE_S | PA2PTE(spa);
+    if(half)
+      *pte |= PTE_H;
+  }
+  acquire(ZRMAP_LOCK(zidx));
+  zrmap[zidx].first = h->first;
+  zrmap[zidx].n = h->n;
+  zrmap[zidx].gen++;
+  pagetable_t pagetable = h->n == 1 ? h->first->pagetable : 0;
+  uint64 va = h->first->va;
+  release(ZRMAP_LOCK(zidx));
+  h->first = 0;
+  h->n = 0;
+  h->gen++;
+  h->idle = h->ksm = 0;
+  zlru_add(zidx, pagetable, va);
+}
 
-  acquire(&ipt_lock);
-  int idx = pa2idx_normal(pa);
-  pagetable_t pagetable = ipt[idx].pagetable;
-  uint64 va = ipt[idx].va;
+#ifdef PART3
+// Per-CPU LZO output; LZO expands incompressible input by up to
+// 1/16th plus a few bytes, and lzo_copy() may run 15 bytes over.
+#define LZO_OUT_MAX (PGSIZE + PGSIZE / 16 + 64 + 3 + 16)
+static char lzo_out[NCPU][LZO_OUT_MAX];
+
+// Early abort: a strided sample of ZSAMPLE bytes from random or
+// already-compressed data has about 162 distinct values; text,
+// code and integer arrays have far fewer.
+#define ZSAMPLE       256
+#define ZDISTINCT_MAX 140
+
+static int zcompressible(const uchar *p)
+{
+  uint64 seen[4] = { 0, 0, 0, 0 };
+  int i, n = 0;
+
+  for(i = 0; i < PGSIZE; i += PGSIZE / ZSAMPLE){
+    uint64 bit = 1UL << (p[i] & 63);
+    if((seen[p[i] >> 6] & bit) == 0){
+      seen[p[i] >> 6] |= bit;
+      if(++n > ZDISTINCT_MAX)
+        return 0;
+    }
+  }
+  return 1;
+}
+#endif
 
-  pte_t* pte = walk(pagetable, va, 0);
-  if(pte == 0){
-    return 0;
+// Store the page at pa in a new ZONE_ZMEM object.
+// A page that does not compress into a ZHALF object gains
+// nothing from compression, so it is kept raw (cp_length ZRAW)
+// and swapin() just copies it back.
+// Runs without kmem_normal.lock; each CPU has its own LZO
+// work memory, used with interrupts off.
+// Returns the object, or 0 if ZONE_ZMEM is full.
+void* zstore(uint64 pa, int *half)
+{
+  void *swap_pa;
+
+  #ifdef PART3
+  unsigned int length = PGSIZE;
+  const char *src;
+
+  push_off();
+  char *out = lzo_out[cpuid()];
+  if(zcompressible((const uchar *)pa)){
+    lzo1x_compress((const unsigned char *)pa, PGSIZE , (unsigned char *)out,
+                   &length, (void*) WRKMEM_CPU(cpuid()));
+  } else {
+    length = ZRAW;
+    nzabort++;
+  }
+  if(length > HPGSIZE){
+    src = (const char *)pa;
+    length = ZRAW;
+  } else {
+    src = out;
+  }
+
+  *half = (length <= HPGSIZE);
+  swap_pa = zalloc(*half ? ZHALF : ZFULL);
+  if(swap_pa){
+    memmove(swap_pa, src, length);
+    cp_length[pa2idx_zmem((uint64)swap_pa)] = length;
+    if(length == ZRAW)
+      nzraw++;
+  }
+  pop_off();
+  #else
+  *half = 0;
+  swap_pa = zalloc(ZFULL);
+  if(swap_pa){
+    memmove(swap_pa, (void*)pa, PGSIZE);
+    cp_length[pa2idx_zmem((uint64)swap_pa)] = ZRAW;
+  }
+  #endif
+  return swap_pa;
+}
+
+// Copy the page held by ZONE_ZMEM object zpa into dst.
+void zload(uint64 zpa, char *dst)
+{
+  int size = cp_length[pa2idx_zmem(zpa)];
+
+  if(size == ZRAW){
+    memmove(dst, (void*)zpa, PGSIZE);
+    return;
   }
-  
   #ifdef PART3
-  void* compress = kalloc(ZONE_FIXED);
-  unsigned int length= 4096;
-  
-  acquire(&lzo_lock);
-  
-  lzo1x_compress((const unsigned char *)pa, PGSIZE , compress, &length, (void*) WRKMEM); 
-  
-  release(&lzo_lock);
-  
-
-  if(length <= HPGSIZE){
-
-    swap_pa = zalloc(ZHALF);
-    if(swap_pa == 0){
-      kfree(compress,ZONE_FIXED);
-      return 0;
+  unsigned int length = PGSIZE;
+  int error = lzo1x_decompress((const unsigned char *)zpa, size,
+                               (unsigned char *)dst, &length);
+  if(error < 0 || length != PGSIZE){
+    printf("error: %d size: %d ",error,size);
+    panic("decompress error");
+  }
+  #else
+  panic("zload");
+  #endif
+}
+
+// Batched reclaim.
+//
+// swapout_batch() isolates up to k victims under kmem_normal.lock,
+// leaves out those another hart may still write through a stale
+// TLB entry (kscand waits for that hart instead), compresses the
+// rest (with the lock dropped if droplock is set),
+// then retakes the lock, rewrites the PTEs of every victim that did
+// not change in the meantime, and flushes the TLB once for the
+// whole batch instead of once per page.
+
+struct victim {
+  uint64 pa;
+  int idx;
+  uint gen;
+  void *zpa;
+  int half;
+};
+
+// Return 1 if another hart may be running user code, on TLB entries
+// from before epoch, in a page table that maps the frame of h.
+// A hart that returns to user space after we look flushes on the
+// way, since it sets inuser before it reads tlbepoch.
+static int rmap_busy(struct rmap_head *h, uint epoch)
+{
+  struct cpu *c, *me = mycpu();
+  struct proc *p;
+  struct rmap *m;
+
+  for(c = cpus; c < &cpus[NCPU]; c++){
+    if(c == me || !__atomic_load_n(&c->inuser, __ATOMIC_SEQ_CST) ||
+       (int)(__atomic_load_n(&c->tlbepoch, __ATOMIC_SEQ_CST) - epoch) >= 0)
+      continue;
+    if((p = c->proc) == 0)
+      continue;
+    for(m = h->first; m; m = m->next)
+      if(m->pagetable == p->pagetable)
+        return 1;
+  }
+  return 0;
+}
+
+// Pick up to k frames from the head of the FIFO, clean their PTEs
+// so that a later write shows up as PTE_D, and pin them against
+// other reclaimers. Only frames that went unaccessed for at least
+// minidle kscand scans are taken, and only those charged to memory
+// group cg unless it is -1. Sets *epoch to that of the TLB flush.
+// kmem_normal.lock must be held.
+static int swapout_isolate(struct victim *v, int k, int minidle, int cg, uint *epoch)
+{
+  struct run *r;
+  int n, idx, tries;
+
+  for(n = 0, tries = 0; n < k && tries < MEM; tries++){
+    r = cg < 0 ? dequeue() : (struct run*)dequeue_memcg(cg);
+    if(r == 0)
+      break;
+    idx = pa2idx_normal((uint64)r);
+    enqueue((uint64)r);
+    // frames that are not mapped yet, or are pinned, are skipped.
+    if(ipt[idx].n == 0 || ipt[idx].pin != 0 || ipt[idx].idle < minidle)
+      continue;
+    acquire(IPT_LOCK(idx));
+    if(rmap_check(&ipt[idx], (uint64)r, 1) < 0)
+      panic("swapout: rmap");
+    v[n].pa = (uint64)r;
+    v[n].idx = idx;
+    v[n].gen = ipt[idx].gen;
+    ipt[idx].pin++;
+    release(IPT_LOCK(idx));
+    n++;
+  }
+  if(n > 0)
+    *epoch = uvmflush(0, -1);
+  return n;
+}
+
+// Unpin the victims and swap out those that are still mapped as
+// they were when isolated and clean. Returns the frames in out.
+// kmem_normal.lock must be held.
+static int swapout_commit(struct victim *v, int n, void **out)
+{
+  struct rmap_head *h;
+  int i, dirty, done = 0;
+
+  for(i = 0; i < n; i++){
+    h = &ipt[v[i].idx];
+    acquire(IPT_LOCK(v[i].idx));
+    h->pin--;
+    if(v[i].zpa == 0){
+      release(IPT_LOCK(v[i].idx));
+      continue;
     }
-    memmove(swap_pa, compress, length);
+    dirty = (h->gen != v[i].gen || h->n == 0) ? 1 : rmap_check(h, v[i].pa, 0);
+    if(dirty){
+      release(IPT_LOCK(v[i].idx));
+      zfree(v[i].zpa, v[i].half ? ZHALF : ZFULL);
+      continue;
+    }
+    rmap_swapout(v[i].idx, v[i].zpa, v[i].half);
+    nswapout++;
+    release(IPT_LOCK(v[i].idx));
+    out[done++] = (void*)v[i].pa;
+  }
+  if(done > 0)
+    uvmflush(0, -1);
+  return done;
+}
 
-    int h_idx = pa2idx_zmem((uint64)swap_pa);
-    cp_length[h_idx] = length;
+// Evict up to k (at most SWAPOUT_BATCH) of the oldest mapped frames
+// in ZONE_NORMAL to ZONE_ZMEM, unmapping each from every process
+// that shares it. The frames are returned in out, still allocated.
+// Returns how many were evicted, with kmem_normal.lock held.
+// If droplock is set the lock is released during compression,
+// so the caller must not rely on anything it looked up under it.
+// If wait is set, which only kscand may do, victims that another
+// hart is running on are waited for rather than left out; nobody
+// else may spin until the next timer tick, since the caller may
+// hold locks or have interrupts off.
+static int swapout_victims(void **out, int k, int droplock, int wait, int minidle, int cg)
+{
+  struct victim v[SWAPOUT_BATCH];
+  int i, n, busy;
+  uint epoch;
+
+  if(k > SWAPOUT_BATCH)
+    k = SWAPOUT_BATCH;
+  acquire_normal_lock();
+  n = swapout_isolate(v, k, minidle, cg, &epoch);
+  // all that is left may be megapages
+  if(n == 0 && minidle == 0 && cg < 0 && megasplit_one())
+    n = swapout_isolate(v, k, 0, cg, &epoch);
+  if(n == 0)
+    return 0;
 
-    swap_pa = (void*)((uint64)swap_pa << 1);
+  // another hart still running a victim's process on a cached
+  // writable, dirty entry could write without setting PTE_D,
+  // and swapout_commit() would not notice.
+  for(i = 0; i < n; i++){
+    v[i].zpa = 0;
+    if(wait)
+      continue;
+    acquire(IPT_LOCK(v[i].idx));
+    busy = rmap_busy(&ipt[v[i].idx], epoch);
+    release(IPT_LOCK(v[i].idx));
+    // swapout_commit() just unpins it
+    if(busy)
+      v[i].pa = 0;
+  }
+  if(droplock)
+    release_normal_lock();
+  if(wait)
+    uvmflush_wait(epoch);
+  for(i = 0; i < n; i++)
+    if(v[i].pa)
+      v[i].zpa = zstore(v[i].pa, &v[i].half);
+  if(droplock)
+    acquire_normal_lock();
+
+  return swapout_commit(v, n, out);
+}
 
-    *pte &= ~PTE_V;
-    *pte |= PTE_S;
-    *pte |= PTE_H;
+int swapout_batch(void **out, int k, int droplock)
+{
+  return swapout_victims(out, k, droplock, 0, 0, -1);
+}
 
-    *pte = PTE_FLAGS(*pte) | PA2PTE(swap_pa);
+// Like swapout_batch(), but evict only frames charged to memory
+// group cg; see memcg_reclaim().
+int swapout_memcg(void **out, int k, int droplock, int cg)
+{
+  return swapout_victims(out, k, droplock, 0, 0, cg);
+}
+
+// Evict one frame; see swapout_batch().
+void* swapout(int droplock)
+{
+  void *pa;
+
+  for(int i = 0; i < MEM; i++){
+    if(swapout_batch(&pa, 1, droplock) == 1)
+      return pa;
   }
-  else{
-    swap_pa = zalloc(ZFULL);
-    if(swap_pa == 0){
-      kfree(compress,ZONE_FIXED);
-      return 0;
-    }
-  
-    memmove(swap_pa, compress, length);
-    int h_idx = pa2idx_zmem((uint64)swap_pa);
-    cp_length[h_idx] = length;
+  return 0;
+}
+
+// Map the frame pa, which now holds the contents of the object
+// named by swap PTE spte, into every PTE that shared the object,
+// and free the object.
+static void rmap_swapin(pte_t spte, uint64 pa)
+{
+  int type;
+  uint64 zpa = zpte2pa(spte, &type);
+  int zidx = pa2idx_zmem(zpa), idx = ipt_idx(pa);
+  struct rmap_head *zh = &zrmap[zidx];
+  struct rmap_head *h = &ipt[idx];
+  pte_t *pte;
+
+  acquire(IPT_LOCK(idx));
+  acquire(ZRMAP_LOCK(zidx));
+  for(struct rmap *r = zh->first; r; r = r->next){
+    pte = walk(r->pagetable, r->va, 0);
+    if(pte == 0 || (*pte & (PTE_V | PTE_SD)) || (*pte & PTE_S) == 0 ||
+       PTE2PA(*pte) != PTE2PA(spte))
+      panic("swapin: rmap");
+    *pte = (PTE_FLAGS(*pte) & ~(PTE_S | PTE_H)) | PTE_V | PA2PTE(pa);
+    // sharers that are gone leave the last one the owner
+    if(r->cow)
+      *pte |= zh->n > 1 ? PTE_COW : PTE_W;
+    r->cow = 0;
+  }
+  h->first = zh->first;
+  h->n = zh->n;
+  h->gen++;
+  zh->first = 0;
+  zh->n = 0;
+  zh->gen++;
+  release(ZRMAP_LOCK(zidx));
+  release(IPT_LOCK(idx));
+  zfree((void*)zpa, type);
+}
 
-    *pte &= ~PTE_V;
-    *pte |= PTE_S;
-    *pte &= ~PTE_H;
+// Bring the page whose swap PTE maps va back into a ZONE_NORMAL
+// frame, and map it into every PTE that shared it. Returns with
+// kmem_normal.lock held, like kalloc(ZONE_NORMAL). Returns the
+// frame, or 0 if none could be had; the PTE is then left as it
+// was, for the caller to fail the fault.
+void* swapin(pagetable_t pagetable, uint64 va){
+  void *pa = kalloc(ZONE_NORMAL);
+  if(pa == 0)
+    return 0;
 
-    *pte = PTE_FLAGS(*pte) | PA2PTE(swap_pa);
+  pte_t *pte = walk(pagetable, va, 0);
+  if(pte == 0){
+    panic("swapin: invalid page table entry");
+  }
+  if(*pte & PTE_SD){
+    panic("swapin: page is on disk");
   }
-  
-  kfree(compress,ZONE_FIXED);
+  pte_t spte = *pte;
+  int type;
 
-  ipt[idx].pagetable = 0;
-  ipt[idx].va = 0;
+  zload(zpte2pa(spte, &type), pa);
+  rmap_swapin(spte, (uint64)pa);
 
   sfence_vma_page(va);
+  nswapin++;
+  return pa;
+}
 
-  enqueue(pa);
+// Swap readahead for sequential faults.
+//
+// Called from usertrap() right after swapin() of va, with
+// kmem_normal.lock held. If the process faults on the page right
+// after its previous readahead window, the window doubles (up to
+// RA_MAX) and the next ra_win compressed neighbours are swapped in
+// now. Their PTE_A bits are cleared, so on the next fault we can
+// tell how many were used; if fewer than half were, the window is
+// halved. A non-sequential fault turns readahead off.
+void swapin_readahead(struct proc *p, uint64 va) {
+  pagetable_t pagetable = p->pagetable;
+  uint64 a;
+  pte_t *pte;
+  int i, issued = 0, used = 0;
+
+  va = PGROUNDDOWN(va);
+
+  for(i = 0; i < 64 && p->ra_mask; i++){
+    if((p->ra_mask & (1UL << i)) == 0)
+      continue;
+    issued++;
+    pte = walk(pagetable, p->ra_start + i * PGSIZE, 0);
+    if(pte && (*pte & PTE_V) && (*pte & PTE_A))
+      used++;
+  }
+  nrahit += used;
+
+  if(issued > 0 && used * 2 < issued)
+    p->ra_win /= 2;
+  else if(va == p->ra_next)
+    p->ra_win = p->ra_win ? p->ra_win * 2 : 1;
+  else
+    p->ra_win = 0;
+  if(p->ra_win > RA_MAX)
+    p->ra_win = RA_MAX;
+
+  p->ra_start = va + PGSIZE;
+  p->ra_mask = 0;
+  for(i = 0; i < p->ra_win; i++){
+    a = p->ra_start + i * PGSIZE;
+    if(a >= p->sz || walkmega(pagetable, a))
+      break;
+    pte = walk(pagetable, a, 0);
+    if(pte == 0)
+      break;
+    if(*pte & PTE_V)
+      continue;
+    // stop at holes and at pages that would need disk I/O
+    if((*pte & PTE_S) == 0 || (*pte & PTE_SD))
+      break;
+    if(swapin(pagetable, a) == 0)
+      break;
+    *pte &= ~PTE_A;
+    sfence_vma_page(a);
+    p->ra_mask |= 1UL << i;
+    nreadahead++;
+  }
+  p->ra_next = p->ra_start + i * PGSIZE;
+}
+// ZONE_ZMEM writeback to the swap area on disk.
+//
+// When free space in ZONE_ZMEM drops below ZWB_LOW half pages,
+// the oldest stored objects are written to disk slots in batches
+// of ZWB_BATCH until ZWB_HIGH half pages are free. A written-back
+// page keeps PTE_S, loses PTE_H, gains PTE_SD, and its PPN field
+// holds the slot number. Disk I/O sleeps, so writeback and
+// readback only run where no spinlock is held.
+
+#define ZWB_LOW     (NUM_HPAGES / 32)
+#define ZWB_HIGH    (NUM_HPAGES / 16)
+#define ZWB_BATCH   8
+
+static int zfree_hpages(void) {
+  return NUM_HPAGES - zalloc2k - 2 * zalloc4k;
+}
 
-  nswapout++;
-  release(&ipt_lock);
+// Can the current process sleep, i.e. does it hold no spinlocks?
+static int cansleep(void) {
+  int noff;
 
-  #else
+  push_off();
+  noff = mycpu()->noff;
+  pop_off();
+  return myproc() != 0 && noff == 1;
+}
 
-  swap_pa = zalloc(ZFULL);
-  if(swap_pa == 0){
-    return 0;
+// Write back up to n of the oldest objects in ZONE_ZMEM.
+// Returns the number of pages moved to disk.
+static int zwriteback_batch(int n) {
+  struct {
+    int idx;
+    uint seq;
+    int len;
+    int slot;
+    char *buf;
+  } wb[ZWB_BATCH];
+  int i, k, nwb = 0, done = 0;
+
+  if(n > ZWB_BATCH)
+    n = ZWB_BATCH;
+  for(k = 0; k < n; k++){
+    if((wb[k].buf = kalloc(ZONE_FIXED)) == 0)
+      break;
   }
-  memmove(swap_pa, (void*)pa, PGSIZE);
+  n = k;
 
-  *pte &= ~PTE_V;
-  *pte |= PTE_S;
+  // Copy out the victims under the locks that swapin()/uvmunmap()
+  // hold while they free ZONE_ZMEM objects.
+  acquire_normal_lock();
+  acquire(&zmem.lock);
+  for(i = zmem_lru.head; i != -1 && nwb < n; i = zmem_lru.objs[i].next){
+    if(zmem_lru.objs[i].pagetable == 0 || zrmap[i].n != 1)
+      continue;
+    wb[nwb].idx = i;
+    wb[nwb].seq = zmem_lru.objs[i].seq;
+    wb[nwb].len = cp_length[i];
+    memmove(wb[nwb].buf, (void*)idx2pa_zmem(i), cp_length[i]);
+    nwb++;
+  }
+  release(&zmem.lock);
+  release_normal_lock();
+
+  for(k = 0; k < nwb; k++){
+    if((wb[k].slot = swap_alloc()) < 0)
+      break;
+    swap_write(wb[k].slot, wb[k].buf, wb[k].len);
+  }
+  nwb = k;
+
+  // Switch the PTEs of objects that were not freed in the meantime.
+  acquire_normal_lock();
+  for(k = 0; k < nwb; k++){
+    struct zmem_info *z = &zmem_lru.objs[wb[k].idx];
+    pte_t *pte;
+
+    acquire(&zmem.lock);
+    int same = z->in_lru && z->seq == wb[k].seq &&
+               z->pagetable != 0 && zrmap[wb[k].idx].n == 1;
+    pagetable_t pagetable = z->pagetable;
+    uint64 va = z->va;
+    int type = zmem_page_allocated[wb[k].idx];
+    release(&zmem.lock);
 
-  *pte = PTE_FLAGS(*pte) | PA2PTE(swap_pa);
+    if(!same){
+      swap_put(wb[k].slot);
+      continue;
+    }
+    pte = walk(pagetable, va, 0);
+    if(pte == 0 || (*pte & PTE_V) || (*pte & PTE_S) == 0 || (*pte & PTE_SD))
+      panic("zwriteback: pte");
+    *pte = (PTE_FLAGS(*pte) & ~PTE_H) | PTE_SD | SLOT2PTE(wb[k].slot);
+    // the only mapper of a page it shared copy-on-write owns it
+    acquire(ZRMAP_LOCK(wb[k].idx));
+    if(zrmap[wb[k].idx].first->cow)
+      *pte |= PTE_W;
+    release(ZRMAP_LOCK(wb[k].idx));
+    zrmap_drop(wb[k].idx);
+    zfree((void*)idx2pa_zmem(wb[k].idx), type);
+    nwriteback++;
+    done++;
+  }
+  release_normal_lock();
 
-  ipt[idx].pagetable = 0;
-  ipt[idx].va = 0;
-  
-  sfence_vma_page(va);
-  enqueue(pa);
+  for(k = 0; k < n; k++)
+    kfree(wb[k].buf, ZONE_FIXED);
+  return done;
+}
 
-  nswapout++;
-  release(&ipt_lock);
-  #endif
+// Called on the way back to user space.
+void zwriteback(void) {
+  if(zfree_hpages() >= ZWB_LOW || !cansleep())
+    return;
+  while(zfree_hpages() < ZWB_HIGH){
+    if(zwriteback_batch(ZWB_BATCH) == 0)
+      break;
+  }
+}
 
-  return (void*)pa;
+// kalloc(ZONE_NORMAL) could not swap anything out, perhaps because
+// ZONE_ZMEM is full. If the caller held no spinlock before taking
+// kmem_normal.lock, write a batch of ZONE_ZMEM to disk with that
+// lock dropped, so that the caller can retry. Returns the number
+// of pages written back, with kmem_normal.lock held.
+int zwriteback_sync(void) {
+  int n = 0;
+
+  release_normal_lock();
+  if(cansleep())
+    n = zwriteback_batch(ZWB_BATCH);
+  acquire_normal_lock();
+  return n;
 }
 
-void* swapin(pagetable_t pagetable, uint64 va){
-  void *pa = kalloc(ZONE_NORMAL);
-  if(pa == 0){
-    panic("swapin: failed to allocate memory");
+// Bring the page at va back from its disk slot into ZONE_ZMEM,
+// so that swapin() can finish the job without sleeping.
+// Returns 0 if va is no longer on disk, -1 on failure.
+int zreadback(pagetable_t pagetable, uint64 va) {
+  pte_t *pte;
+  char *buf;
+  void *zpa;
+  int slot, len, type;
+
+  va = PGROUNDDOWN(va);
+  if(walkmega(pagetable, va) || (pte = walk(pagetable, va, 0)) == 0 ||
+     (*pte & PTE_SD) == 0)
+    return 0;
+  if(!cansleep())
+    return -1;
+  if((buf = kalloc(ZONE_FIXED)) == 0)
+    return -1;
+  slot = PTE2SLOT(*pte);
+  len = swap_read(slot, buf);
+  type = (len <= HPGSIZE) ? ZHALF : ZFULL;
+
+  if((zpa = zalloc(type)) == 0){
+    zwriteback_batch(ZWB_BATCH);
+    zpa = zalloc(type);
+  }
+  if(zpa == 0){
+    kfree(buf, ZONE_FIXED);
+    return -1;
   }
 
-  pte_t *pte = walk(pagetable, va, 0);
-  if(pte == 0){
-    panic("swapin: invalid page table entry");
+  acquire_normal_lock();
+  if((*pte & PTE_SD) == 0 || PTE2SLOT(*pte) != slot){
+    release_normal_lock();
+    zfree(zpa, type);
+    kfree(buf, ZONE_FIXED);
+    return 0;
   }
+  memmove(zpa, buf, len);
+  cp_length[pa2idx_zmem((uint64)zpa)] = len;
+  ztrack(zpa, pagetable, va);
+  if(type == ZHALF)
+    *pte = (PTE_FLAGS(*pte) & ~PTE_SD) | PTE_H | PA2PTE((uint64)zpa << 1);
+  else
+    *pte = (PTE_FLAGS(*pte) & ~(PTE_SD | PTE_H)) | PA2PTE(zpa);
+  swap_put(slot);
+  nreadback++;
+  release_normal_lock();
+
+  kfree(buf, ZONE_FIXED);
+  return 0;
+}
 
-  #ifdef PART3
-  uint64 swap_pa = PTE2PA(*pte);
-  int size;
-  if(*pte & PTE_H){
-    // size = HPGSIZE;
-    swap_pa = swap_pa >> 1;
+// Read back every on-disk page in [va, va+len), and fault in every
+// page never touched, before the caller takes a spinlock and copies
+// to or from user memory.
+void zreadback_range(pagetable_t pagetable, uint64 va, uint64 len) {
+  uint64 a;
+
+  if(len == 0)
+    return;
+  for(a = PGROUNDDOWN(va); a < va + len && a < MAXVA; a += PGSIZE){
+    zreadback(pagetable, a);
+    vmprefault(pagetable, a);
   }
-  else{
-    // size = PGSIZE;
-  }
-  int h_idx = pa2idx_zmem((uint64)swap_pa);
-  size = cp_length[h_idx];
-  void* decompress = kalloc(ZONE_FIXED);
-  unsigned int length = 4096;
-  int error = lzo1x_decompress((const unsigned char *)swap_pa, size, decompress, &length);
-  if(error < 0){
-    printf("error: %d size: %d ",error,size);
-    panic("decompress error");
+}
+
+// kswapd: background reclaim for ZONE_NORMAL.
+//
+// kalloc(ZONE_NORMAL) wakes kswapd when fewer than KSWAPD_LOW frames
+// are free. kswapd then swaps out FIFO victims until KSWAPD_HIGH
+// frames are free, so most allocations are served from the freelist
+// instead of compressing a page on the faulting process's path.
+// kswapd holds no locks between pages, so it also does the disk
+// writeback for ZONE_ZMEM, and compacts it when ZCOMPACT_MIN pages
+// are only half used.
+
+struct {
+  struct spinlock lock;
+  struct proc *proc;
+  int pending;
+} kswapd;
+
+// Called with kmem_normal.lock held; takes only kswapd's own locks.
+void kswapd_wakeup(void) {
+  if(kswapd.proc == 0 || kswapd.pending)
+    return;
+  acquire(&kswapd.lock);
+  kswapd.pending = 1;
+  wakeproc(kswapd.proc, &kswapd);
+  release(&kswapd.lock);
+}
+
+static void kswapd_main(void) {
+  for(;;){
+    acquire(&kswapd.lock);
+    while(!kswapd.pending)
+      sleep(&kswapd, &kswapd.lock);
+    release(&kswapd.lock);
+
+    int need;
+    while((need = KSWAPD_HIGH - (MEM - nalloc4k)) > 0){
+      void *pa[SWAPOUT_BATCH];
+      int n = swapout_batch(pa, need, 1);
+      for(int i = 0; i < n; i++)
+        kfree(pa[i], ZONE_NORMAL);
+      nkswapd += n;
+      release_normal_lock();
+      if(n == 0)
+        break;
+    }
+    zwriteback();
+    if(zmem.nfree_2kb >= ZCOMPACT_MIN)
+      zcompact(zmem.nfree_2kb / 2);
+
+    acquire(&kswapd.lock);
+    kswapd.pending = 0;
+    release(&kswapd.lock);
   }
-  memmove(pa, decompress, PGSIZE);
-  kfree(decompress, ZONE_FIXED);
-  int isHalf = (*pte) & PTE_H;
-  *pte = PTE_FLAGS(*pte) | PA2PTE(pa);
-  *pte |= PTE_V;
-  *pte &= ~PTE_S;
-  *pte &= ~PTE_H;
+}
 
-  sfence_vma_page(va);
+void kswapdinit(void) {
+  initlock(&kswapd.lock, "kswapd");
+  kswapd.pending = 0;
+  kswapd.proc = kproc(kswapd_main, "kswapd");
+}
+
+// kscand: working-set estimation and reclaim ahead of need.
+//
+// Every KSCAN_TICKS, when a CPU has nothing else to run, kscand
+// clears the accessed bits of every mapped ZONE_NORMAL frame and
+// counts, per frame, the scans in a row it found them all clear.
+// Frames idle for KSCAN_IDLE scans are then swapped out until
+// KSCAN_FREE frames are free, so that bursts of allocation find
+// free frames without compressing on the faulting path, and pages
+// in active use are left alone.
 
-  if(isHalf){
-    zfree((void*)swap_pa, ZHALF);
+struct {
+  struct spinlock lock;
+  struct proc *proc;
+  int pending;
+  uint last;          // ticks at the last scan
+} kscan;
+
+// Clear the accessed bits of all mapped frames and age them.
+static void kscan_age(void) {
+  struct rmap *r;
+  pte_t *pte;
+  int idx, accessed;
+
+  acquire_normal_lock();
+  for(idx = 0; idx < NUM_PHYSPAGES; idx++){
+    if(ipt[idx].n == 0)
+      continue;
+    acquire(IPT_LOCK(idx));
+    accessed = 0;
+    for(r = ipt[idx].first; r; r = r->next){
+      pte = walk(r->pagetable, r->va, 0);
+      if(pte && (*pte & PTE_V) && (*pte & PTE_A)){
+        __sync_fetch_and_and(pte, ~PTE_A);
+        accessed = 1;
+      }
+    }
+    if(accessed)
+      ipt[idx].idle = 0;
+    else if(ipt[idx].idle < 255)
+      ipt[idx].idle++;
+    release(IPT_LOCK(idx));
   }
-  else{
-    zfree((void*)swap_pa, ZFULL);
+  // every hart's TLB may cache PTE_A as set
+  uvmflush(0, -1);
+  release_normal_lock();
+}
+
+#ifdef KSM
+// Same-page merging.
+//
+// Under memory pressure kscand also looks for frames with the same
+// contents, such as zero-filled buffers or data that forked children
+// never wrote, and merges them into one copy-on-write frame. A write
+// to a merged page splits it off again through cowcopy(), just as
+// after fork().
+//
+// Only frames all of whose PTEs are writable or copy-on-write are
+// merged. A read-only PTE may belong to a writable MAP_SHARED
+// mapping, which vmadirty() makes writable in place on its first
+// write.
+//
+// A frame is merged only if its checksum, kept in ipt[].sum, was the
+// same on the previous scan, so pages that are still being written
+// are not write-protected for nothing.
+
+#define KSM_NHASH 64
+
+static int ksmhead[KSM_NHASH];
+static int ksmnext[NUM_PHYSPAGES];
+
+static uint64 ipt_pa(int idx)
+{
+  return NORMAL_START + (uint64)idx * PGSIZE;
+}
+
+static uint ksm_sum(uint64 pa)
+{
+  uint64 *w = (uint64*)pa, h = 0;
+  int i;
+
+  for(i = 0; i < PGSIZE / sizeof(uint64); i++)
+    h = (h ^ w[i]) * 0x100000001b3UL;
+  return (uint)(h ^ (h >> 32));
+}
+
+// The chain's lock must be held.
+static int ksm_mergeable(int idx)
+{
+  struct rmap *r;
+  pte_t *pte;
+
+  if(ipt[idx].n == 0 || ipt[idx].pin != 0)
+    return 0;
+  for(r = ipt[idx].first; r; r = r->next){
+    pte = walk(r->pagetable, r->va, 0);
+    if(pte == 0 || (*pte & (PTE_V | PTE_U)) != (PTE_V | PTE_U) ||
+       PTE2PA(*pte) != ipt_pa(idx) || (*pte & (PTE_W | PTE_COW)) == 0)
+      return 0;
   }
-  update_ipt((uint64)pa,pagetable,va);
-  nswapin++;
-  #else
-  uint64 swap_pa = PTE2PA(*pte);
-  memmove(pa, (void*)swap_pa, PGSIZE);
+  return 1;
+}
 
-  *pte = PTE_FLAGS(*pte) | PA2PTE(pa);
-  *pte |= PTE_V;
-  *pte &= ~PTE_S;
+// Make the writable PTEs on a chain copy-on-write.
+// The chain's lock must be held; the caller flushes the TLB.
+static void ksm_protect(struct rmap_head *h)
+{
+  struct rmap *r;
+  pte_t *pte;
 
-  sfence_vma_page(va);
-  zfree((void*)swap_pa, ZFULL);
-  update_ipt((uint64)pa,pagetable,va);
-  nswapin++;
-  #endif
-  return pa;
-  
-}
\ No newline at end of file
+  for(r = h->first; r; r = r->next){
+    pte = walk(r->pagetable, r->va, 0);
+    if(*pte & PTE_W)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
+  }
+}
+
+// Take the locks of frames a and b, in stripe order.
+static void ksm_lock(int a, int b)
+{
+  struct spinlock *la = IPT_LOCK(a), *lb = IPT_LOCK(b);
+
+  acquire(la < lb ? la : lb);
+  if(la != lb)
+    acquire(la < lb ? lb : la);
+}
+
+static void ksm_unlock(int a, int b)
+{
+  release(IPT_LOCK(a));
+  if(IPT_LOCK(a) != IPT_LOCK(b))
+    release(IPT_LOCK(b));
+}
+
+// Map every PTE of frame idx to frame kidx and free idx, if
+// their contents are the same. Both are write-protected first,
+// so neither can change while they are compared; if they differ
+// they stay so until the next write takes them over again.
+// kmem_normal.lock must be held. Returns 1 if merged.
+static int ksm_merge(int kidx, int idx)
+{
+  struct rmap_head *k = &ipt[kidx], *h = &ipt[idx];
+  struct rmap *r;
+  pte_t *pte;
+  int same = 0;
+
+  ksm_lock(kidx, idx);
+  if(ksm_mergeable(kidx) && ksm_mergeable(idx)){
+    ksm_protect(k);
+    ksm_protect(h);
+    uvmflush(0, -1);
+    same = memcmp((void*)ipt_pa(kidx), (void*)ipt_pa(idx), PGSIZE) == 0;
+  }
+  if(same){
+    for(r = h->first; ; r = r->next){
+      pte = walk(r->pagetable, r->va, 0);
+      *pte = PA2PTE(ipt_pa(kidx)) | PTE_FLAGS(*pte);
+      if(r->next == 0)
+        break;
+    }
+    r->next = k->first;
+    k->first = h->first;
+    k->n += h->n;
+    k->gen++;
+    k->idle = k->idle < h->idle ? k->idle : h->idle;
+    k->ksm = 1;
+    h->first = 0;
+    h->n = 0;
+    h->gen++;
+    h->idle = h->ksm = 0;
+  }
+  ksm_unlock(kidx, idx);
+  if(same){
+    uvmflush(0, -1);
+    kfree((void*)ipt_pa(idx), ZONE_NORMAL);
+    nksmmerge++;
+  }
+  return same;
+}
+
+// Hash the mergeable frames and merge those that are stable and
+// identical to one hashed before them.
+static void ksm_scan(void)
+{
+  uint64 t0 = r_time();
+  int idx, j, ok;
+  uint sum;
+
+  acquire_normal_lock();
+  for(j = 0; j < KSM_NHASH; j++)
+    ksmhead[j] = -1;
+  for(idx = 0; idx < NUM_PHYSPAGES; idx++){
+    acquire(IPT_LOCK(idx));
+    ok = ksm_mergeable(idx);
+    release(IPT_LOCK(idx));
+    if(!ok)
+      continue;
+    sum = ksm_sum(ipt_pa(idx));
+    nksmscan++;
+    if(sum != ipt[idx].sum){
+      ipt[idx].sum = sum;
+      continue;
+    }
+    for(j = ksmhead[sum % KSM_NHASH]; j >= 0; j = ksmnext[j])
+      if(ipt[j].sum == sum && ksm_merge(j, idx))
+        break;
+    if(j < 0){
+      ksmnext[idx] = ksmhead[sum % KSM_NHASH];
+      ksmhead[sum % KSM_NHASH] = idx;
+    }
+  }
+  release_normal_lock();
+  ksmticks += r_time() - t0;
+}
+
+// Frames that merging saves now: the extra PTEs on merged frames.
+static int ksm_sharing(void)
+{
+  int idx, n = 0;
+
+  for(idx = 0; idx < NUM_PHYSPAGES; idx++)
+    if(ipt[idx].ksm && ipt[idx].n > 1)
+      n += ipt[idx].n - 1;
+  return n;
+}
+#endif
+
+// Called from scheduler() with no locks held.
+// Returns 1 if kscand was given work.
+int kscan_idle(void) {
+  if(kscan.proc == 0 || kscan.pending || ticks - kscan.last < KSCAN_TICKS)
+    return 0;
+  acquire(&kscan.lock);
+  kscan.pending = 1;
+  kscan.last = ticks;
+  wakeproc(kscan.proc, &kscan);
+  release(&kscan.lock);
+  return 1;
+}
+
+static void kscand_main(void) {
+  for(;;){
+    acquire(&kscan.lock);
+    while(!kscan.pending)
+      sleep(&kscan, &kscan.lock);
+    release(&kscan.lock);
+
+    kscan_age();
+#ifdef KSM
+    if(MEM - nalloc4k < KSCAN_FREE)
+      ksm_scan();
+#endif
+    int need;
+    while((need = KSCAN_FREE - (MEM - nalloc4k)) > 0){
+      void *pa[SWAPOUT_BATCH];
+      int n = swapout_victims(pa, need, 1, 1, KSCAN_IDLE, -1);
+      for(int i = 0; i < n; i++)
+        kfree(pa[i], ZONE_NORMAL);
+      nkscand += n;
+      release_normal_lock();
+      if(n == 0)
+        break;
+    }
+
+    acquire(&kscan.lock);
+    kscan.pending = 0;
+    release(&kscan.lock);
+  }
+}
+
+void kscandinit(void) {
+  initlock(&kscan.lock, "kscan");
+  kscan.pending = 0;
+  kscan.proc = kproc(kscand_main, "kscand");
+}
@@ -16,6 +16,8 @@
 // Memory zones
 #include "memlayout.h"
 
+struct proc;
+
 #define ZONE_FIXED  0
 #define ZONE_NORMAL 1
 #define ZONE_ZMEM   2
@@ -24,28 +26,99 @@
 #define ZHALF       2
 #define ZFULL       4
 
+// cp_length[] of a page stored uncompressed
+#define ZRAW        PGSIZE
+
+
+// kswapd watermarks, in free ZONE_NORMAL frames
+#define KSWAPD_LOW  (MEM / 8 + 1)
+#define KSWAPD_HIGH (MEM / 4 + 1)
+
+// max frames reclaimed per swapout_batch()
+#define SWAPOUT_BATCH (MEM / 8 + 1 < 16 ? MEM / 8 + 1 : 16)
+
+// kscand: ticks between scans of the accessed bits, scans a frame
+// must go unaccessed before it is reclaimed ahead of need, and the
+// free ZONE_NORMAL frames it tries to keep that way
+#define KSCAN_TICKS 10
+#define KSCAN_IDLE  3
+#define KSCAN_FREE  (MEM / 2)
+
+// 2MB-aligned runs of ZONE_NORMAL that uvmalloc() may map as
+// megapages. kalloc_mega() only takes a run that is entirely free
+// and never reclaims to make one, and init and sh always hold
+// frames in one run, so megapages need MEM=1024 or more.
+#define NMEGA       (MEM / 512)
+
+// free ZONE_NORMAL frames kzerod keeps zero-filled
+#define KZERO_POOL  (MEM / 4)
+
+// ZONE_ZMEM compaction: half-used pages that make kswapd compact,
+// and pages a failed zalloc(ZFULL) makes whole before it retries
+#define ZCOMPACT_MIN    (ZMEM / 64 + 2)
+#define ZCOMPACT_BATCH  8
+
+// max swap readahead window in pages (must be <= 64)
+#define RA_MAX      (MEM / 4)
 
 // LZO compression library
 #define LZO1X_1_MEM_COMPRESS      (16*1024)
 
 
 
+// Disk slot encoding for swapped-out PTEs on the swap device
+// (PTE_S and PTE_SD set, PTE_V and PTE_H clear).
+#define SLOT2PTE(slot)  (((uint64)(slot)) << 10)
+#define PTE2SLOT(pte)   ((int)((pte) >> 10))
+
 extern int nalloc4k, zalloc4k, zalloc2k;
 extern int nswapin, nswapout;
+extern int nwriteback, nreadback;
+extern int nkswapd;
+extern int nreadahead, nrahit;
+extern int nzraw, nzabort;
+extern int nkscand;
+extern int ntlbflush;
+extern int nzcompact;
+extern int nswapslot;
 
 void zfreerange(void *pa_start, void *pa_end);
 void* zalloc(int type);
 void zfree(void* pa, int type);
 void mallocstat(void);
 void initAlloc(void);
-void* swapout(void);
+void* swapout(int droplock);
+int swapout_batch(void **out, int k, int droplock);
+int swapout_memcg(void **out, int k, int droplock, int cg);
 void* swapin(pagetable_t, uint64 va);
-void update_ipt(uint64 pa, pagetable_t pagetable, uint64 va);
+void swapin_readahead(struct proc *p, uint64 va);
+void rmap_add(uint64 pa, pagetable_t pagetable, uint64 va);
+int rmap_remove(uint64 pa, pagetable_t pagetable, uint64 va);
+int rmap_count(uint64 pa);
+void rmap_pin(uint64 pa, int pin);
+void* zstore(uint64 pa, int *half);
+void zload(uint64 zpa, char *dst);
+void zdup(pte_t *pte, pagetable_t old, pagetable_t new, uint64 va);
+void zput(pte_t pte, pagetable_t pagetable, uint64 va);
+void sfence_vma_page(uint64 va);
+void ztrack(void *zpa, pagetable_t pagetable, uint64 va);
+void zwriteback(void);
+int zwriteback_sync(void);
+void kswapdinit(void);
+void kswapd_wakeup(void);
+void kscandinit(void);
+int kscan_idle(void);
+int zreadback(pagetable_t pagetable, uint64 va);
+void zreadback_range(pagetable_t pagetable, uint64 va, uint64 len);
+
+// swapdisk.c
+void swapdisk_init(void);
+int swap_alloc(void);
+void swap_dup(int slot);
+void swap_put(int slot);
+void swap_write(int slot, char *src, int len);
+int swap_read(int slot, char *dst);
 
 int pa2idx_normal(uint64 pa);
 void init_zmem(void);
 int pa2idx_zmem(uint64 pa);
-void acquire_ipt_lock(uint64 pa);
-void release_ipt_lock(uint64 pa);
-int holding_pa(uint64 pa);
-extern struct spinlock ipt_lock;
@@ -0,0 +1,401 @@
+// Run the in-kernel allocator microbenchmarks.
+//
+//   $ kbench zfree
+//   $ kbench zstore
+//   $ kbench lzo
+//   $ kbench forkexec [nproc [n]]
+//   $ kbench tlb [rounds]
+//   $ kbench mmap [pages]
+//   $ kbench syscall [n]
+//   $ kbench shm [kb]
+//
+// The in-kernel tests report elapsed r_time() ticks (10MHz on qemu);
+// the others run in user space and report uptime() ticks.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define KBENCH_ZFREE      1
+#define KBENCH_ZSTORE     2
+#define KBENCH_LZO_C      3
+#define KBENCH_LZO_D      4
+
+static int frags[] = { 0, 64, 256, 1024, 2048 };
+
+void
+bench_zfree(void)
+{
+  int i;
+
+  printf("zfree: 256 buddy merges behind N free 2KB fragments\n");
+  for(i = 0; i < sizeof(frags)/sizeof(frags[0]); i++)
+    printf("  N = %d\t%d ticks\n", frags[i], kbench(KBENCH_ZFREE, frags[i]));
+}
+
+void
+bench_zstore(void)
+{
+  static char *names[] = { "swaptest", "random" };
+  int i;
+  long t;
+
+  printf("zstore: 256 page swap-out/swap-in round trips through ZONE_ZMEM\n");
+  for(i = 0; i < 2; i++){
+    t = kbench(KBENCH_ZSTORE, i);
+    if(t < 0)
+      printf("  %s\tfailed\n", names[i]);
+    else
+      printf("  %s\t%d ticks\n", names[i], (int)t);
+  }
+}
+
+// 256 pages at 10M ticks/s: MB/s = 256 * 4096 * 10 / ticks
+static void
+lzo_rate(char *what, int test, int pattern)
+{
+  long t = kbench(test, pattern);
+
+  if(t <= 0)
+    printf("  %s\tfailed\n", what);
+  else
+    printf("  %s\t%d ticks\t%d MB/s\n", what, (int)t, (int)(256L * 4096 * 10 / t));
+}
+
+void
+bench_lzo(void)
+{
+  printf("lzo: 256 pages, swaptest-like and random\n");
+  lzo_rate("compress swaptest", KBENCH_LZO_C, 0);
+  lzo_rate("decompress swaptest", KBENCH_LZO_D, 0);
+  lzo_rate("compress random", KBENCH_LZO_C, 1);
+  lzo_rate("decompress random", KBENCH_LZO_D, 1);
+}
+
+// nproc workers each fork and exec "kbench nop" n times.
+// Every round trip allocates and frees a kernel stack, trapframe
+// and page-table pages, so this mostly measures kalloc(ZONE_FIXED)
+// and kfree() under contention from all harts.
+void
+bench_forkexec(int nproc, int n)
+{
+  char *argv[] = { "kbench", "nop", 0 };
+  int i, j, pid, start;
+
+  start = uptime();
+  for(i = 0; i < nproc; i++){
+    if((pid = fork()) < 0){
+      fprintf(2, "kbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      for(j = 0; j < n; j++){
+        if((pid = fork()) < 0)
+          exit(1);
+        if(pid == 0){
+          exec(argv[0], argv);
+          exit(1);
+        }
+        wait(0);
+      }
+      exit(0);
+    }
+  }
+  for(i = 0; i < nproc; i++)
+    wait(0);
+  printf("forkexec: %d procs x %d fork+exec\t%d ticks\n",
+         nproc, n, uptime() - start);
+}
+
+// Touch one word in each page of a 2MB heap region, in a scattered
+// order, rounds times. The first region starts on a 2MB boundary,
+// so uvmlazy() can map it with one megapage; the second starts a
+// page past one and gets 512 4KB pages. The page before it is
+// touched while it is the end of the heap, so that the 2MB the
+// second region begins in cannot become a megapage either. The
+// difference is the cost of the extra TLB misses. The first region
+// needs a 2MB run of ZONE_NORMAL that is entirely free, and the
+// second 512 more frames (make MEM=1536); with less, both regions
+// are 4KB pages or the second one swaps. Then a child is forked and
+// the aligned region timed again in both: fork() copies a megapage
+// whole instead of splitting it, so neither should slow down as
+// long as the child finds a third free run (make MEM=2048).
+#define MEGA (512 * 4096)
+
+static int
+touch(char *a, int rounds)
+{
+  int i, j, start;
+
+  start = uptime();
+  for(i = 0; i < rounds; i++)
+    for(j = 0; j < 512; j++)
+      a[((j * 97) % 512) * 4096] += 1;
+  return uptime() - start;
+}
+
+void
+bench_tlb(int rounds)
+{
+  uint64 brk = (uint64)sbrk(0);
+  char *a, *b, *gap;
+  int pid;
+
+  if(sbrk(MEGA - brk % MEGA) == (char*)-1 || (a = sbrk(MEGA)) == (char*)-1 ||
+     (gap = sbrk(4096)) == (char*)-1){
+    fprintf(2, "kbench: sbrk failed\n");
+    exit(1);
+  }
+  *gap = 0;
+  if((b = sbrk(MEGA)) == (char*)-1){
+    fprintf(2, "kbench: sbrk failed\n");
+    exit(1);
+  }
+  touch(a, 1);
+  touch(b, 1);
+  printf("tlb: 512 pages x %d rounds\n", rounds);
+  printf("  aligned 2MB\t%d ticks\n", touch(a, rounds));
+  printf("  unaligned 2MB\t%d ticks\n", touch(b, rounds));
+  if((pid = fork()) < 0){
+    fprintf(2, "kbench: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    printf("  aligned, child\t%d ticks\n", touch(a, rounds));
+    exit(0);
+  }
+  wait(0);
+  printf("  aligned, parent\t%d ticks\n", touch(a, rounds));
+}
+
+// Sum a file of npages pages 100 times, with read() through a
+// page-sized buffer and by mmap()ing it. Keep npages well under
+// MEM, or the mmap() scan measures swapping instead.
+#define MMAP_ROUNDS 100
+
+void
+bench_mmap(int npages)
+{
+  static char buf[4096];
+  int fd, i, r, start, tread, tmmap;
+  uint sum0 = 0, sum1 = 0;
+  char *a;
+
+  if((fd = open("kbench.tmp", O_CREATE|O_TRUNC|O_RDWR)) < 0){
+    fprintf(2, "kbench: cannot create kbench.tmp\n");
+    exit(1);
+  }
+  for(i = 0; i < npages; i++){
+    memset(buf, i, sizeof(buf));
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      fprintf(2, "kbench: write failed\n");
+      exit(1);
+    }
+  }
+  close(fd);
+
+  start = uptime();
+  for(r = 0; r < MMAP_ROUNDS; r++){
+    fd = open("kbench.tmp", O_RDONLY);
+    while(read(fd, buf, sizeof(buf)) == sizeof(buf))
+      for(i = 0; i < sizeof(buf); i += 64)
+        sum0 += buf[i];
+    close(fd);
+  }
+  tread = uptime() - start;
+
+  start = uptime();
+  for(r = 0; r < MMAP_ROUNDS; r++){
+    fd = open("kbench.tmp", O_RDONLY);
+    if((a = mmap(0, npages * 4096, PROT_READ, MAP_PRIVATE, fd, 0)) == (char*)-1){
+      fprintf(2, "kbench: mmap failed\n");
+      exit(1);
+    }
+    close(fd);
+    for(i = 0; i < npages * 4096; i += 64)
+      sum1 += a[i];
+    munmap(a, npages * 4096);
+  }
+  tmmap = uptime() - start;
+  unlink("kbench.tmp");
+
+  printf("mmap: %d pages x %d scans%s\n", npages, MMAP_ROUNDS,
+         sum0 == sum1 ? "" : " (checksum mismatch!)");
+  printf("  read\t%d ticks\n", tread);
+  printf("  mmap\t%d ticks\n", tmmap);
+}
+
+// Touch 8 heap pages between n getpid() calls, and the same with
+// no system calls. Before ASIDs every return to user space flushed
+// the TLB, so the first loop paid 8 TLB refills per call; the
+// "tlbflush" count of ^x shows how often it still happens.
+#define SYSCALL_PAGES 8
+
+void
+bench_syscall(int n)
+{
+  static char a[SYSCALL_PAGES * 4096];
+  int i, j, start, tsys, tnone;
+
+  for(j = 0; j < SYSCALL_PAGES; j++)
+    a[j * 4096] = 1;
+
+  start = uptime();
+  for(i = 0; i < n; i++){
+    getpid();
+    for(j = 0; j < SYSCALL_PAGES; j++)
+      a[j * 4096] += 1;
+  }
+  tsys = uptime() - start;
+
+  start = uptime();
+  for(i = 0; i < n; i++)
+    for(j = 0; j < SYSCALL_PAGES; j++)
+      a[j * 4096] += 1;
+  tnone = uptime() - start;
+
+  printf("syscall: %d pages x %d rounds\n", SYSCALL_PAGES, n);
+  printf("  getpid+touch\t%d ticks\n", tsys);
+  printf("  touch\t%d ticks\n", tnone);
+}
+
+// Stream kb KB from a producer to a consumer process in 512-byte
+// chunks, through a pipe and through a ring in a shared memory
+// segment. The producer writes each chunk in place in the ring and
+// the consumer checks it there, where a pipe copies it in and out
+// of the kernel. Both sides spin while the ring is full or empty,
+// so run this with more than one CPU.
+#define SHM_CHUNK 512
+#define SHM_RING  (3 * 4096)
+
+struct ring {
+  volatile uint head;          // bytes produced
+  char pad[60];
+  volatile uint tail;          // bytes consumed
+  char buf[SHM_RING];
+};
+
+static void
+fill(char *buf, uint pos)
+{
+  int i;
+
+  for(i = 0; i < SHM_CHUNK; i++)
+    buf[i] = pos + i;
+}
+
+static int
+check(char *buf, uint pos)
+{
+  int i;
+
+  for(i = 0; i < SHM_CHUNK; i++)
+    if(buf[i] != (char)(pos + i))
+      return 1;
+  return 0;
+}
+
+void
+bench_shm(int kb)
+{
+  static char buf[SHM_CHUNK];
+  uint total = kb * 1024, pos;
+  int fds[2], id, bad, start, tpipe, tshm, st0, st1;
+  struct ring *r;
+
+  if(pipe(fds) < 0){
+    fprintf(2, "kbench: pipe failed\n");
+    exit(1);
+  }
+  start = uptime();
+  if(fork() == 0){
+    close(fds[1]);
+    bad = 0;
+    for(pos = 0; pos < total; pos += SHM_CHUNK){
+      if(read(fds[0], buf, SHM_CHUNK) != SHM_CHUNK){
+        bad = 1;
+        break;
+      }
+      bad |= check(buf, pos);
+    }
+    exit(bad);
+  }
+  close(fds[0]);
+  for(pos = 0; pos < total; pos += SHM_CHUNK){
+    fill(buf, pos);
+    write(fds[1], buf, SHM_CHUNK);
+  }
+  close(fds[1]);
+  wait(&st0);
+  tpipe = uptime() - start;
+
+  if((id = shmget(0, sizeof(struct ring))) < 0 ||
+     (r = shmat(id)) == (struct ring*)-1){
+    fprintf(2, "kbench: shmget/shmat failed\n");
+    exit(1);
+  }
+  r->head = r->tail = 0;
+  start = uptime();
+  if(fork() == 0){
+    bad = 0;
+    for(pos = 0; pos < total; pos += SHM_CHUNK){
+      while(r->head == pos)
+        ;
+      __sync_synchronize();
+      bad |= check(r->buf + pos % SHM_RING, pos);
+      __sync_synchronize();
+      r->tail = pos + SHM_CHUNK;
+    }
+    exit(bad);
+  }
+  for(pos = 0; pos < total; pos += SHM_CHUNK){
+    while(pos - r->tail >= SHM_RING)
+      ;
+    __sync_synchronize();
+    fill(r->buf + pos % SHM_RING, pos);
+    __sync_synchronize();
+    r->head = pos + SHM_CHUNK;
+  }
+  wait(&st1);
+  tshm = uptime() - start;
+  shmdt(r);
+
+  printf("shm: %d KB in %d-byte chunks%s\n", kb, SHM_CHUNK,
+         st0 == 0 && st1 == 0 ? "" : " (data mismatch!)");
+  printf("  pipe\t%d ticks\n", tpipe);
+  printf("  shm\t%d ticks\n", tshm);
+}
+
+int
+main(int argc, char *argv[])
+{
+  if(argc < 2){
+    fprintf(2, "usage: kbench zfree | zstore | lzo | forkexec [nproc [n]] | tlb [rounds] | mmap [pages] | syscall [n] | shm [kb]\n");
+    exit(1);
+  }
+
+  if(strcmp(argv[1], "nop") == 0)
+    exit(0);
+  if(strcmp(argv[1], "zfree") == 0)
+    bench_zfree();
+  else if(strcmp(argv[1], "zstore") == 0)
+    bench_zstore();
+  else if(strcmp(argv[1], "lzo") == 0)
+    bench_lzo();
+  else if(strcmp(argv[1], "forkexec") == 0)
+    bench_forkexec(argc > 2 ? atoi(argv[2]) : 4, argc > 3 ? atoi(argv[3]) : 100);
+  else if(strcmp(argv[1], "tlb") == 0)
+    bench_tlb(argc > 2 ? atoi(argv[2]) : 2000);
+  else if(strcmp(argv[1], "mmap") == 0)
+    bench_mmap(argc > 2 ? atoi(argv[2]) : 8);
+  else if(strcmp(argv[1], "syscall") == 0)
+    bench_syscall(argc > 2 ? atoi(argv[2]) : 100000);
+  else if(strcmp(argv[1], "shm") == 0)
+    bench_shm(argc > 2 ? atoi(argv[2]) : 4096);
+  else {
+    fprintf(2, "kbench: unknown test %s\n", argv[1]);
+    exit(1);
+  }
+  exit(0);
+}
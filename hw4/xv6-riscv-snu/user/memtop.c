@@ -0,0 +1,79 @@
+// Show per-process memory usage and swap-in fault latency,
+// then the memory groups in use, and same-page merging if the
+// kernel has it (make KSM=1).
+//
+//   $ memtop          one line per process
+//   $ memtop -l       also print each process's latency histogram
+//
+// RATIO is the compressed size of the process's ZONE_ZMEM pages as
+// a percentage of their uncompressed size. Latencies are r_time()
+// ticks (10MHz on qemu).
+
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/pmstat.h"
+#include "user/user.h"
+
+static struct pmstat st[NPROC];
+static struct mcgstat cg[NMEMCG];
+static struct ksmstat ks;
+
+void
+histogram(struct pmstat *s)
+{
+  int i;
+
+  for(i = 0; i < NSWAPLAT; i++){
+    if(s->lat[i] == 0)
+      continue;
+    if(i < NSWAPLAT-1)
+      printf("    < %d\t%d\n", 1 << (PMSTAT_LAT0+i), s->lat[i]);
+    else
+      printf("    >= %d\t%d\n", 1 << (PMSTAT_LAT0+i-1), s->lat[i]);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, n, zpages, lflag = 0;
+
+  if(argc > 1 && strcmp(argv[1], "-l") == 0)
+    lflag = 1;
+  if((n = pmemstat(st, NPROC)) < 0){
+    fprintf(2, "memtop: pmemstat failed\n");
+    exit(1);
+  }
+  printf("PID\tNAME\tCG\tRSS\tHALF\tFULL\tDISK\tZBYTES\tRATIO\tFAULTS\n");
+  for(i = 0; i < n; i++){
+    zpages = st[i].half + st[i].full;
+    printf("%d\t%s\t%d\t%d\t%d\t%d\t%d\t%ld\t", st[i].pid, st[i].name,
+      st[i].memcg, st[i].resident, st[i].half, st[i].full, st[i].disk, st[i].zbytes);
+    if(zpages)
+      printf("%d%%", (int)(st[i].zbytes * 100 / ((uint64)zpages * 4096)));
+    else
+      printf("-");
+    printf("\t%d\n", st[i].nswapin);
+    if(lflag && st[i].nswapin)
+      histogram(&st[i]);
+  }
+
+  if((n = memcgstat(cg, NMEMCG)) < 0){
+    fprintf(2, "memtop: memcgstat failed\n");
+    exit(1);
+  }
+  printf("\nCG\tNPROC\tLIMIT\tRSS\tRECLAIM\n");
+  for(i = 0; i < n; i++){
+    printf("%d\t%d\t", cg[i].id, cg[i].nproc);
+    if(cg[i].limit)
+      printf("%d", cg[i].limit);
+    else
+      printf("-");
+    printf("\t%d\t%d\n", cg[i].resident, cg[i].nreclaim);
+  }
+
+  if(ksmstat(&ks) == 0)
+    printf("\nKSM: scanned %d, merged %d, saving %d pages, scan time %d ms\n",
+      ks.nscan, ks.nmerge, ks.sharing, ks.scanms);
+  exit(0);
+}
@@ -45,8 +45,32 @@ void free(void*);
 #ifdef SNU
 // xswap.c
 int memstat(int *, int *, int *, int *, int *);
+struct pmstat;
+int pmemstat(struct pmstat *, int);
+struct mcgstat;
+int memcg(int);
+int memcgstat(struct mcgstat *, int);
+struct ksmstat;
+int ksmstat(struct ksmstat *);
+
+// mmap.c
+void *mmap(void *, int, int, int, int, int);
+int munmap(void *, int);
+int madvise(void *, int, int);
+
+// shm.c
+int shmget(int, int);
+void *shmat(int);
+int shmdt(void *);
+
+// sysproc.c
+int setrlimit(int, uint64);
+uint64 getrlimit(int);
 
 // ktest.c
 void *ktest1(int, int);
 void ktest2(int, void *);
+
+// kbench.c
+int kbench(int, int);
 #endif
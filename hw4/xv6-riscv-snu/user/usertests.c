@@ -7,6 +7,8 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/resource.h"
+#include "kernel/pmstat.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -2586,6 +2588,420 @@ badarg(char *s)
   exit(0);
 }
 
+#ifdef SNU
+// recurse about a page of stack per level, n levels deep.
+int
+stackdeep(int n)
+{
+  volatile char frame[PGSIZE - 256];
+
+  frame[0] = n;
+  if(n == 0)
+    return 0;
+  return stackdeep(n - 1) + frame[0] - n;
+}
+
+// fork a child that execs usertests -stack n, after a setrlimit()
+// of lim bytes if lim is not 0. Returns its exit status.
+int
+stackchild(char *s, uint64 lim, int n)
+{
+  char num[16], *argv[] = { "usertests", "-stack", 0, 0 };
+  int pid, xstatus, i = sizeof(num) - 1;
+
+  num[i] = 0;
+  do {
+    num[--i] = '0' + n % 10;
+    n /= 10;
+  } while(n > 0);
+  argv[2] = &num[i];
+  if((pid = fork()) < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(lim && setrlimit(RLIMIT_STACK, lim) < 0){
+      printf("%s: setrlimit(%d) failed\n", s, (int)lim);
+      exit(2);
+    }
+    exec("usertests", argv);
+    printf("%s: exec usertests failed\n", s);
+    exit(2);
+  }
+  wait(&xstatus);
+  return xstatus;
+}
+
+// the stack grows past what exec() maps, up to RLIMIT_STACK.
+void
+stackgrow(char *s)
+{
+  if(getrlimit(RLIMIT_STACK) != STACKDEF * PGSIZE){
+    printf("%s: default RLIMIT_STACK is %d\n", s, (int)getrlimit(RLIMIT_STACK));
+    exit(1);
+  }
+  if(setrlimit(RLIMIT_STACK, USERSTACK * PGSIZE - 1) != -1 ||
+     setrlimit(RLIMIT_STACK, (STACKMAX + 1) * PGSIZE) != -1 ||
+     setrlimit(-1, STACKDEF * PGSIZE) != -1 ||
+     setrlimit(NRLIMIT, STACKDEF * PGSIZE) != -1 ||
+     getrlimit(-1) != (uint64)-1 || getrlimit(NRLIMIT) != (uint64)-1){
+    printf("%s: out-of-range rlimit accepted\n", s);
+    exit(1);
+  }
+  if(getrlimit(RLIMIT_STACK) != STACKDEF * PGSIZE){
+    printf("%s: rejected setrlimit() changed the limit\n", s);
+    exit(1);
+  }
+  if(stackdeep(STACKDEF / 2) != 0){
+    printf("%s: deep recursion returned garbage\n", s);
+    exit(1);
+  }
+  if(stackchild(s, 0, STACKDEF / 2) != 0){
+    printf("%s: recursion within the default limit failed\n", s);
+    exit(1);
+  }
+  if(stackchild(s, 2 * STACKDEF * PGSIZE, 3 * STACKDEF / 2) != 0){
+    printf("%s: recursion within a raised limit failed\n", s);
+    exit(1);
+  }
+  if(stackchild(s, 16 * PGSIZE, 32) != -1){
+    printf("%s: recursion past a lowered limit was not killed\n", s);
+    exit(1);
+  }
+}
+
+// create name with npages pages, page i filled with 'a'+i.
+void
+mkpages(char *s, char *name, int npages)
+{
+  int fd, i;
+
+  if((fd = open(name, O_CREATE|O_TRUNC|O_RDWR)) < 0){
+    printf("%s: create %s failed\n", s, name);
+    exit(1);
+  }
+  for(i = 0; i < npages; i++){
+    memset(buf, 'a' + i, PGSIZE);
+    if(write(fd, buf, PGSIZE) != PGSIZE){
+      printf("%s: write %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  close(fd);
+}
+
+// the first byte of each of the npages pages of name, in c.
+void
+firstbytes(char *s, char *name, int npages, char *c)
+{
+  int fd, i;
+
+  if((fd = open(name, O_RDONLY)) < 0){
+    printf("%s: open %s failed\n", s, name);
+    exit(1);
+  }
+  for(i = 0; i < npages; i++){
+    if(read(fd, buf, PGSIZE) != PGSIZE){
+      printf("%s: read %s failed\n", s, name);
+      exit(1);
+    }
+    c[i] = buf[0];
+  }
+  close(fd);
+}
+
+// mmap() and munmap() of a file, private and shared.
+void
+mmaptest(char *s)
+{
+  char *p, c[4];
+  int fd, i, pid, xstatus;
+
+  mkpages(s, "mmapf", 4);
+  if((fd = open("mmapf", O_RDONLY)) < 0){
+    printf("%s: open mmapf failed\n", s);
+    exit(1);
+  }
+  if(mmap(0, 4*PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) != (char*)-1){
+    printf("%s: writable MAP_SHARED of a read-only fd\n", s);
+    exit(1);
+  }
+  if(mmap(0, 4*PGSIZE, PROT_READ, MAP_SHARED, fd, 1) != (char*)-1){
+    printf("%s: mmap at an unaligned offset\n", s);
+    exit(1);
+  }
+
+  // private: writes stay in the process
+  if((p = mmap(0, 4*PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0)) == (char*)-1){
+    printf("%s: MAP_PRIVATE mmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  for(i = 0; i < 4; i++){
+    if(p[i*PGSIZE] != 'a' + i || p[i*PGSIZE + PGSIZE-1] != 'a' + i){
+      printf("%s: MAP_PRIVATE page %d has the wrong contents\n", s, i);
+      exit(1);
+    }
+    p[i*PGSIZE] = 'P';
+  }
+  if(munmap(p + PGSIZE, PGSIZE) != -1){
+    printf("%s: munmap of a middle page succeeded\n", s);
+    exit(1);
+  }
+  if(munmap(p, 4*PGSIZE) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  firstbytes(s, "mmapf", 4, c);
+  if(c[0] != 'a' || c[3] != 'd'){
+    printf("%s: MAP_PRIVATE write reached the file\n", s);
+    exit(1);
+  }
+
+  // shared: writes reach other mappers at once, and the file
+  if((fd = open("mmapf", O_RDWR)) < 0 ||
+     (p = mmap(0, 4*PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == (char*)-1){
+    printf("%s: MAP_SHARED mmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(p[2*PGSIZE] != 'c'){
+    printf("%s: MAP_SHARED page 2 has the wrong contents\n", s);
+    exit(1);
+  }
+  if((pid = fork()) < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    p[0] = 'X';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || p[0] != 'X'){
+    printf("%s: MAP_SHARED write of a child not seen\n", s);
+    exit(1);
+  }
+
+  // a prefix and a suffix, then the rest
+  if(munmap(p, PGSIZE) < 0 || munmap(p + 3*PGSIZE, PGSIZE) < 0){
+    printf("%s: partial munmap failed\n", s);
+    exit(1);
+  }
+  p[PGSIZE] = 'Y';
+  if((pid = fork()) < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    printf("%s: read unmapped page %d\n", s, p[0]);
+    exit(1);
+  }
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: touching an unmapped page was not killed\n", s);
+    exit(1);
+  }
+  if(munmap(p + PGSIZE, 2*PGSIZE) < 0){
+    printf("%s: munmap of the rest failed\n", s);
+    exit(1);
+  }
+  firstbytes(s, "mmapf", 4, c);
+  if(c[0] != 'X' || c[1] != 'Y' || c[2] != 'c' || c[3] != 'd'){
+    printf("%s: MAP_SHARED writes did not reach the file\n", s);
+    exit(1);
+  }
+  unlink("mmapf");
+}
+
+// a shared memory segment is shared across fork(), and by key.
+void
+shmtest(char *s)
+{
+  char *p, *q;
+  int id, pid, xstatus;
+
+  if((id = shmget(4711, 2*PGSIZE)) < 0 || (p = shmat(id)) == (char*)-1){
+    printf("%s: shmget/shmat failed\n", s);
+    exit(1);
+  }
+  if(shmget(4711, 3*PGSIZE) != -1){
+    printf("%s: shmget of a larger existing segment succeeded\n", s);
+    exit(1);
+  }
+  if(p[0] != 0 || p[2*PGSIZE-1] != 0){
+    printf("%s: new segment not zeroed\n", s);
+    exit(1);
+  }
+  p[0] = 1;
+  if((pid = fork()) < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    // the inherited attachment and a new one map the same pages
+    if(shmget(4711, PGSIZE) != id || (q = shmat(id)) == (char*)-1){
+      printf("%s: child shmget/shmat failed\n", s);
+      exit(1);
+    }
+    if(p[0] != 1 || q[0] != 1){
+      printf("%s: child does not see the parent's write\n", s);
+      exit(1);
+    }
+    q[PGSIZE] = 2;
+    if(p[PGSIZE] != 2){
+      printf("%s: two attachments differ\n", s);
+      exit(1);
+    }
+    if(shmdt(q) < 0){
+      printf("%s: child shmdt failed\n", s);
+      exit(1);
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  if(p[PGSIZE] != 2){
+    printf("%s: parent does not see the child's write\n", s);
+    exit(1);
+  }
+  if(shmdt(p + PGSIZE) != -1 || shmdt(p) < 0 || shmdt(p) != -1){
+    printf("%s: shmdt misbehaved\n", s);
+    exit(1);
+  }
+}
+
+// MADV_DONTNEED drops pages: heap pages come back zeroed, those of a
+// file mapping from the file, after a shared one is written back.
+void
+madvtest(char *s)
+{
+  char *p, c[2];
+  int fd, i;
+
+  if((p = sbrk(4*PGSIZE)) == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 4*PGSIZE; i += 512)
+    p[i] = 7;
+  if(madvise(p + 1, PGSIZE, MADV_DONTNEED) != -1 ||
+     madvise(p, PGSIZE, 99) != -1 ||
+     madvise(p, 64*PGSIZE, MADV_DONTNEED) != -1){
+    printf("%s: bad madvise() accepted\n", s);
+    exit(1);
+  }
+  if(madvise(p, 4*PGSIZE, MADV_WILLNEED) < 0 ||
+     madvise(p, 4*PGSIZE, MADV_SEQUENTIAL) < 0 ||
+     madvise(p, 4*PGSIZE, MADV_NORMAL) < 0){
+    printf("%s: madvise() hint failed\n", s);
+    exit(1);
+  }
+  if(madvise(p + PGSIZE, 2*PGSIZE, MADV_DONTNEED) < 0){
+    printf("%s: MADV_DONTNEED of the heap failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 4*PGSIZE; i += 512){
+    if(p[i] != (i >= PGSIZE && i < 3*PGSIZE ? 0 : 7)){
+      printf("%s: heap byte %d is %d after MADV_DONTNEED\n", s, i, p[i]);
+      exit(1);
+    }
+  }
+  sbrk(-4*PGSIZE);
+
+  mkpages(s, "madvf", 2);
+  if((fd = open("madvf", O_RDWR)) < 0){
+    printf("%s: open madvf failed\n", s);
+    exit(1);
+  }
+  if((p = mmap(0, 2*PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0)) == (char*)-1){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  p[0] = 'Z';
+  if(madvise(p, 2*PGSIZE, MADV_DONTNEED) < 0 || p[0] != 'a' || p[PGSIZE] != 'b'){
+    printf("%s: MAP_PRIVATE page not read again from the file\n", s);
+    exit(1);
+  }
+  munmap(p, 2*PGSIZE);
+
+  if((p = mmap(0, 2*PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == (char*)-1){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  p[PGSIZE] = 'Q';
+  if(madvise(p, 2*PGSIZE, MADV_DONTNEED) < 0 || p[PGSIZE] != 'Q'){
+    printf("%s: MAP_SHARED write lost by MADV_DONTNEED\n", s);
+    exit(1);
+  }
+  firstbytes(s, "madvf", 2, c);
+  if(c[0] != 'a' || c[1] != 'Q'){
+    printf("%s: MADV_DONTNEED did not write back\n", s);
+    exit(1);
+  }
+  munmap(p, 2*PGSIZE);
+  unlink("madvf");
+}
+
+// a memory group stays within its limit by evicting its own pages,
+// which come back intact.
+#define MCG_LIMIT  16
+#define MCG_PAGES  (4 * MCG_LIMIT)
+
+void
+memcgtest(char *s)
+{
+  struct mcgstat cg[NMEMCG];
+  char *p;
+  int g, i, n, pid, xstatus;
+
+  if(memcg(-1) != -1){
+    printf("%s: memcg(-1) succeeded\n", s);
+    exit(1);
+  }
+  if((pid = fork()) < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if((g = memcg(MCG_LIMIT)) <= 0){
+      printf("%s: memcg failed\n", s);
+      exit(1);
+    }
+    if((p = sbrk(MCG_PAGES*PGSIZE)) == (char*)-1){
+      printf("%s: sbrk failed\n", s);
+      exit(1);
+    }
+    for(i = 0; i < MCG_PAGES; i++)
+      p[i*PGSIZE] = i;
+    for(i = 0; i < MCG_PAGES; i++){
+      if(p[i*PGSIZE] != (char)i){
+        printf("%s: page %d lost its contents\n", s, i);
+        exit(1);
+      }
+    }
+    n = memcgstat(cg, NMEMCG);
+    for(i = 0; i < n && cg[i].id != g; i++)
+      ;
+    if(i == n){
+      printf("%s: group %d not in memcgstat\n", s, g);
+      exit(1);
+    }
+    if(cg[i].limit != MCG_LIMIT || cg[i].nproc != 1 ||
+       cg[i].resident > MCG_LIMIT || cg[i].nreclaim == 0){
+      printf("%s: group %d: limit %d, nproc %d, resident %d, reclaim %d\n", s,
+             g, cg[i].limit, cg[i].nproc, cg[i].resident, cg[i].nreclaim);
+      exit(1);
+    }
+    exit(0);
+  }
+  wait(&xstatus);
+  exit(xstatus);
+}
+#endif
+
 struct test {
   void (*f)(char *);
   char *s;
@@ -2656,6 +3072,13 @@ struct test {
   {sbrklast, "sbrklast"},
   {sbrk8000, "sbrk8000"},
   {badarg, "badarg" },
+#ifdef SNU
+  {stackgrow, "stackgrow"},
+  {mmaptest, "mmap"},
+  {shmtest, "shm"},
+  {madvtest, "madvise"},
+  {memcgtest, "memcg"},
+#endif
 
   { 0, 0},
 };
@@ -3114,6 +3537,11 @@ main(int argc, char *argv[])
   int quick = 0;
   char *justone = 0;
 
+#ifdef SNU
+  // see stackchild()
+  if(argc == 3 && strcmp(argv[1], "-stack") == 0)
+    exit(stackdeep(atoi(argv[2])));
+#endif
   if(argc == 2 && strcmp(argv[1], "-q") == 0){
     quick = 1;
   } else if(argc == 2 && strcmp(argv[1], "-c") == 0){
@@ -40,3 +40,16 @@ entry("uptime");
 entry("memstat");
 entry("ktest1");
 entry("ktest2");
+entry("kbench");
+entry("pmemstat");
+entry("mmap");
+entry("munmap");
+entry("shmget");
+entry("shmat");
+entry("shmdt");
+entry("madvise");
+entry("setrlimit");
+entry("getrlimit");
+entry("memcg");
+entry("memcgstat");
+entry("ksmstat");